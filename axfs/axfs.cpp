@@ -3,401 +3,2362 @@
 // LICENSE: GPL v2.  This project is a derivative work of the linux kernel.
 
 #include "stdafx.h"
+#include "axfs_reader.h"
 
-#define STB_IMAGE_STATIC
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
+// output file written at arbitrary offsets from several threads at once
+struct axfs_output_file
+{
+#ifdef _WIN32
+	HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+	int fd = -1;
+#endif
+
+	~axfs_output_file()
+	{
+		close();
+	}
+
+	// make path an empty file of size bytes, writable by its owner until the mode is applied
+	static bool create(const char* path, uint64_t size)
+	{
+#ifdef _WIN32
+		HANDLE handle = CreateFileA(path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (handle == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER end;
+		end.QuadPart = (LONGLONG) size;
+		bool sized = SetFilePointerEx(handle, end, nullptr, FILE_BEGIN) && SetEndOfFile(handle);
+		CloseHandle(handle);
+		return sized;
+#else
+		int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0)
+			return false;
+		bool sized = ftruncate(fd, (off_t) size) == 0;
+		::close(fd);
+		return sized;
+#endif
+	}
+
+	// open a file made by create for writing, other threads may have it open as well
+	bool open(const char* path)
+	{
+		close();
+#ifdef _WIN32
+		handle = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		return handle != INVALID_HANDLE_VALUE;
+#else
+		fd = ::open(path, O_WRONLY);
+		return fd >= 0;
+#endif
+	}
+
+	// false if not all of data could be written
+	bool writeAt(const void* data, uint64_t length, uint64_t offset)
+	{
+#ifdef _WIN32
+		OVERLAPPED position = {};
+		position.Offset = (DWORD) offset;
+		position.OffsetHigh = (DWORD)(offset >> 32);
+		DWORD written = 0;
+		return WriteFile(handle, data, (DWORD) length, &written, &position) && written == length;
+#else
+		while (length > 0)
+		{
+			auto written = pwrite(fd, data, (size_t) length, (off_t) offset);
+			if (written < 0 && errno == EINTR)
+				continue;
+			if (written <= 0)
+				return false;
+			data = (const u8*) data + written;
+			offset += (uint64_t) written;
+			length -= (uint64_t) written;
+		}
+		return true;
+#endif
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (handle != INVALID_HANDLE_VALUE)
+			CloseHandle(handle);
+		handle = INVALID_HANDLE_VALUE;
+#else
+		if (fd >= 0)
+			::close(fd);
+		fd = -1;
+#endif
+	}
+};
 
-inline uint16_t byteswap(uint16_t v)
+#define AXFS_EXTRACT_TASK_SIZE (1 << 20)	/* bytes of uncompressed pages per task */
+
+// Reproduces the tree of an image on disk.  Directories and empty files are
+// created up front, then the page copies are run on an axfs_work_pool: one task
+// per cblock that inflates it once and writes its pages to every file that
+// references them, plus tasks of up to AXFS_EXTRACT_TASK_SIZE bytes of
+// XIP/byte aligned pages.  A task opens one output file at a time, so trees of
+// any number of files are written with a handful of descriptors.
+// The image is expected to have passed axfs::verify.
+struct axfs_extractor
 {
-	return _byteswap_ushort(v);
+	struct page
+	{
+		uint32_t file;	/* index into outputs */
+		uint32_t length;
+		uint64_t fileOffset;
+		uint64_t nodeOffset;	/* cnode offset for compressed pages */
+	};
+
+	const axfs& fs;
+	std::vector<std::string> paths;	/* indexed by inode */
+	std::vector<uint64_t> outputs;	/* inodes of the files created */
+	std::vector<std::vector<page>> cblockPages;
+	std::vector<std::vector<page>> copyTasks;
+	std::atomic<uint64_t> bytesWritten;
+	std::atomic<uint64_t> writeErrors;	/* pages that could not be written */
+	uint64_t treeErrors = 0;	/* directories, files and symlinks that could not be made */
+
+	explicit axfs_extractor(const axfs& fs)
+		: fs(fs), bytesWritten(0), writeErrors(0)
+	{ }
+
+	static bool makeDirectory(const std::string& path)
+	{
+#ifdef _WIN32
+		return CreateDirectoryA(path.c_str(), nullptr) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+		return mkdir(path.c_str(), 0700) == 0 || errno == EEXIST;
+#endif
+	}
+
+	bool makeSymlink(uint64_t id)
+	{
+		uint64_t size = fs.getFileSize(id);
+		std::vector<char> target((size_t) size + PAGE_CACHE_SIZE);
+		if (!fs.readFile(id, target.data(), 0, size))
+			return false;
+		target[(size_t) size] = 0;
+#ifdef _WIN32
+		printf("%s: symlink to %s skipped\n", paths[id].c_str(), target.data());
+		return true;
+#else
+		return symlink(target.data(), paths[id].c_str()) == 0;
+#endif
+	}
+
+	// a name that stays inside its directory when appended to the path
+	static bool safeName(const char* name)
+	{
+		if (!*name || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			return false;
+#ifdef _WIN32
+		return !strpbrk(name, "/\\:");
+#else
+		return !strchr(name, '/');
+#endif
+	}
+
+	// directories, symlinks and empty output files, in inode order so parents come first
+	void createTree(const char* root)
+	{
+		paths.assign((size_t) fs.superblock.files, std::string());
+		paths[0] = root;
+		for (uint64_t id = 0; id < fs.superblock.files; ++id)
+		{
+			auto mode = fs.getMode(id);
+			if (paths[id].empty())
+				continue; // in no directory, or under one that was not made
+			const char* failed = nullptr;
+			if (S_ISDIR(mode))
+			{
+				if (!makeDirectory(paths[id]))
+					failed = "cannot create directory";
+			}
+			else if (S_ISLNK(mode))
+			{
+				if (!makeSymlink(id))
+					failed = "cannot create symlink";
+			}
+			else if (S_ISREG(mode))
+			{
+				if (axfs_output_file::create(paths[id].c_str(), fs.getFileSize(id)))
+					outputs.push_back(id);
+				else
+					failed = "cannot create";
+			}
+			else
+				printf("%s: special file skipped\n", paths[id].c_str());
+
+			if (failed)
+			{
+				printf("%s: %s\n", paths[id].c_str(), failed);
+				++treeErrors;
+				continue;
+			}
+			if (!S_ISDIR(mode))
+				continue;
+
+			uint64_t first = fs.getArrayIndex(id);
+			uint64_t count = fs.getNumEntries(id);
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				const char* name = fs.getName(first + i);
+				if (safeName(name))
+					paths[first + i] = paths[id] + "/" + name;
+				else
+				{
+					printf("%s: entry %" PRIu64 " has an unsafe name, skipped\n", paths[id].c_str(), i);
+					++treeErrors;
+				}
+			}
+		}
+	}
+
+	// sort every page of every file into per-cblock and plain copy task lists
+	void schedule()
+	{
+		cblockPages.assign((size_t) fs.getCblockCount(), std::vector<page>());
+		std::vector<page> pending;
+		uint64_t pendingBytes = 0;
+
+		for (uint32_t file = 0; file < (uint32_t) outputs.size(); ++file)
+		{
+			uint64_t id = outputs[file];
+			uint64_t size = fs.getFileSize(id);
+			uint64_t arrayIndex = fs.getArrayIndex(id);
+			for (uint64_t offset = 0; offset < size; offset += PAGE_CACHE_SIZE, ++arrayIndex)
+			{
+				page p;
+				p.file = file;
+				p.fileOffset = offset;
+				p.length = (uint32_t) std::min(size - offset, (uint64_t) PAGE_CACHE_SIZE);
+				p.nodeOffset = 0;
+
+				uint64_t nodeIndex = fs.getNodeIndex(arrayIndex);
+				switch (fs.getNodeType(arrayIndex))
+				{
+				case 0: // XIP
+					p.nodeOffset = nodeIndex << PAGE_SHIFT;
+					pending.push_back(p);
+					break;
+				case 2: // Byte_aligned, nodeOffset is tagged by the top bit
+					p.nodeOffset = fs.getByteAlignedOffset(nodeIndex) | (1ull << 63);
+					pending.push_back(p);
+					break;
+				case 1: // Compressed
+					p.nodeOffset = fs.cnode_offset.axfs_bytetable_stitch(nodeIndex);
+					cblockPages[(size_t) fs.cnode_index.axfs_bytetable_stitch(nodeIndex)].push_back(p);
+					continue;
+				default:
+					assert(false);
+					break;
+				}
+
+				pendingBytes += p.length;
+				if (pendingBytes >= AXFS_EXTRACT_TASK_SIZE)
+				{
+					copyTasks.push_back(std::move(pending));
+					pending.clear();
+					pendingBytes = 0;
+				}
+			}
+		}
+		if (!pending.empty())
+			copyTasks.push_back(std::move(pending));
+	}
+
+	// Write one page, opening its file unless the page before went to the same
+	// one.  Pages of a task are grouped by file, so each is opened once per task.
+	void writePage(axfs_output_file& output, uint32_t& openFile, const page& p, const void* src)
+	{
+		if (openFile != p.file)
+		{
+			openFile = p.file;
+			if (!output.open(paths[(size_t) outputs[p.file]].c_str()))
+				printf("%s: cannot open for writing\n", paths[(size_t) outputs[p.file]].c_str());
+		}
+		if (src && output.writeAt(src, p.length, p.fileOffset))
+			bytesWritten += p.length;
+		else
+			++writeErrors;
+	}
+
+	void copyPages(const std::vector<page>& pages)
+	{
+		axfs_output_file output;
+		uint32_t openFile = UINT32_MAX;
+		for (auto& p : pages)
+		{
+			const void* src;
+			if (p.nodeOffset >> 63)
+				src = axfs::offsetAddress(fs.byte_aligned.getData(), p.nodeOffset & ~(1ull << 63));
+			else
+				src = axfs::offsetAddress(fs.xip.getData(), p.nodeOffset);
+			writePage(output, openFile, p, src);
+		}
+	}
+
+	void inflatePages(uint64_t cnodeIndex, const std::vector<page>& pages)
+	{
+		std::vector<u8> cblock(fs.superblock.cblock_size);
+		bool inflated = fs.tryInflateCblock(cnodeIndex, cblock.data()) >= 0;
+		if (!inflated)
+			printf("cblock %" PRIu64 " cannot be inflated\n", cnodeIndex);
+		axfs_output_file output;
+		uint32_t openFile = UINT32_MAX;
+		for (auto& p : pages)
+			writePage(output, openFile, p, inflated ? cblock.data() + p.nodeOffset : nullptr);
+	}
+
+	void applyModes()
+	{
+#ifndef _WIN32
+		// last, so read-only files and directories did not get in the way of filling them
+		for (uint64_t id = 0; id < fs.superblock.files; ++id)
+		{
+			auto mode = fs.getMode(id);
+			if ((S_ISDIR(mode) || S_ISREG(mode)) && !paths[id].empty())
+				chmod(paths[id].c_str(), (mode_t)(mode & 07777));
+		}
+#endif
+	}
+
+	// false if any part of the tree could not be made or written
+	bool extract(const char* root, unsigned threads)
+	{
+		createTree(root);
+		schedule();
+
+		axfs_work_pool pool(threads);
+		uint64_t cblocks = 0;
+		for (size_t i = 0; i < cblockPages.size(); ++i)
+		{
+			if (cblockPages[i].empty())
+				continue;
+			pool.push([this, i] { inflatePages(i, cblockPages[i]); });
+			++cblocks;
+		}
+		for (auto& task : copyTasks)
+			pool.push([this, &task] { copyPages(task); });
+		pool.run();
+
+		applyModes();
+		printf("extracted %" PRIu64 " files, %" PRIu64 " bytes, %" PRIu64 " cblocks inflated once each, %u threads\n",
+			(uint64_t) outputs.size(), (uint64_t) bytesWritten, cblocks, (unsigned) pool.queues.size());
+		if (writeErrors)
+			printf("%" PRIu64 " pages could not be written\n", (uint64_t) writeErrors);
+		if (treeErrors)
+			printf("%" PRIu64 " entries could not be created\n", treeErrors);
+		return writeErrors == 0 && treeErrors == 0;
+	}
+};
+
+// Whole buffer compressor for the image builder, the counterpart of axfs_codec.
+// Output never grows by more than AXFS_COMPRESS_SLACK for any of the backends.
+struct axfs_compressor
+{
+	const char* name;
+	u8 type;	/* the AXFS_COMPRESSION_* it produces */
+	int defaultLevel;
+
+	// compress src into dst, returns the compressed size or -1 if it did not fit into capacity
+	int64_t (*encode)(void* dst, uint64_t capacity, const void* src, uint64_t srcSize, int level);
+};
+
+#define AXFS_COMPRESS_SLACK(size) ((size) / 2 + 4096)
+
+static int64_t axfs_stored_encode(void* dst, uint64_t capacity, const void* src, uint64_t srcSize, int)
+{
+	return axfs_stored_decode(dst, capacity, src, srcSize);
 }
 
-inline uint32_t byteswap(uint32_t v)
+#ifdef AXFS_HAVE_ZLIB
+static int64_t axfs_zlib_encode(void* dst, uint64_t capacity, const void* src, uint64_t srcSize, int level)
 {
-	return _byteswap_ulong(v);
+	uLongf len = (uLongf) capacity;
+	if (compress2((Bytef*)dst, &len, (const Bytef*)src, (uLong) srcSize, level) != Z_OK)
+		return -1;
+	return (int64_t) len;
 }
+#endif
+
+#ifdef AXFS_HAVE_LIBDEFLATE
+static int64_t axfs_libdeflate_encode(void* dst, uint64_t capacity, const void* src, uint64_t srcSize, int level)
+{
+	// one compressor per thread, reallocated if the level changes
+	struct holder
+	{
+		libdeflate_compressor* c = nullptr;
+		int level = -1;
+		~holder() { libdeflate_free_compressor(c); }
+	};
+	static thread_local holder compressor;
+	if (compressor.level != level)
+	{
+		libdeflate_free_compressor(compressor.c);
+		compressor.c = libdeflate_alloc_compressor(level);
+		compressor.level = level;
+	}
+
+	size_t len = libdeflate_zlib_compress(compressor.c, src, (size_t) srcSize, dst, (size_t) capacity);
+	return len ? (int64_t) len : -1;
+}
+#endif
+
+#ifdef AXFS_HAVE_LZ4
+static int64_t axfs_lz4_encode(void* dst, uint64_t capacity, const void* src, uint64_t srcSize, int)
+{
+	int len = LZ4_compress_default((const char*)src, (char*)dst, (int) srcSize, (int) capacity);
+	return len > 0 ? len : -1;
+}
+#endif
+
+#ifdef AXFS_HAVE_ZSTD
+static int64_t axfs_zstd_encode(void* dst, uint64_t capacity, const void* src, uint64_t srcSize, int level)
+{
+	size_t len = ZSTD_compress(dst, (size_t) capacity, src, (size_t) srcSize, level);
+	return ZSTD_isError(len) ? -1 : (int64_t) len;
+}
+#endif
+
+#ifdef AXFS_HAVE_LZMA
+static int64_t axfs_xz_encode(void* dst, uint64_t capacity, const void* src, uint64_t srcSize, int level)
+{
+	size_t outPos = 0;
+	if (lzma_easy_buffer_encode((uint32_t) level, LZMA_CHECK_CRC32, nullptr, (const uint8_t*)src, (size_t) srcSize, (uint8_t*)dst, &outPos, (size_t) capacity) != LZMA_OK)
+		return -1;
+	return (int64_t) outPos;
+}
+#endif
+
+// the compressors built in, preferred first within a compression type
+static const axfs_compressor axfs_compressors[] = {
+#ifdef AXFS_HAVE_LIBDEFLATE
+	{ "libdeflate", AXFS_COMPRESSION_ZLIB, 9, &axfs_libdeflate_encode },
+#endif
+#ifdef AXFS_HAVE_ZLIB
+	{ "zlib", AXFS_COMPRESSION_ZLIB, 9, &axfs_zlib_encode },
+#endif
+#ifdef AXFS_HAVE_LZ4
+	{ "lz4", AXFS_COMPRESSION_LZ4, 0, &axfs_lz4_encode },
+#endif
+#ifdef AXFS_HAVE_ZSTD
+	{ "zstd", AXFS_COMPRESSION_ZSTD, 19, &axfs_zstd_encode },
+#endif
+#ifdef AXFS_HAVE_LZMA
+	{ "xz", AXFS_COMPRESSION_XZ, 6, &axfs_xz_encode },
+#endif
+	{ "stored", AXFS_COMPRESSION_STORED, 0, &axfs_stored_encode },
+};
+
+static const axfs_compressor* axfs_find_compressor(u8 type)
+{
+	for (auto& compressor : axfs_compressors)
+	{
+		if (compressor.type == type)
+			return &compressor;
+	}
+	return nullptr;
+}
+
+#define AXFS_DEFAULT_CBLOCK_SIZE (64 << 10)
+#define AXFS_BUILD_TASK_CBLOCKS 16	/* cblocks compressed per pool task */
+
+struct axfs_build_options
+{
+	uint32_t cblockSize = AXFS_DEFAULT_CBLOCK_SIZE;
+	u8 compressionType = AXFS_COMPRESSION_ZLIB;
+	int level = -1;	/* -1 for the compressor's default */
+	unsigned threads = 1;
+	bool compressMetadata = false;
+	bool perCblockCodec = false;	/* tag every cblock, storing the ones that do not shrink */
+	uint64_t tailLimit = 0;	/* file tails of at most this many bytes go to the byte aligned region */
+	std::string xipProfile;	/* /proc/axfs/volume* output naming the pages to place in the xip region */
+	uint64_t xipBudget = 0;	/* most bytes of xip region, 0 for no limit */
+	bool dedupe = true;	/* pages with the same content and node type share a node */
+	bool localityPacking = true;	/* start files on cblock boundaries when that saves inflates */
+	u8 minTableDepth = 1;	/* bytes per entry of the node and inode tables, at least, within the kernel's planes */
+	uint64_t memoryLimit = 1ull << 30;	/* raw cblock bytes held before they are compressed and spilled to a temporary file */
+	uint64_t timestamp = 0;	/* left at 0 so that images are reproducible */
+};
+
+// A made up tree for the builder, to see how the reader scales with inode count,
+// file size and page placement without a real root filesystem.  Everything is
+// derived from the seed, the same options always give the same image.
+struct axfs_synthetic_options
+{
+	uint64_t files = 1000;
+	uint64_t fanout = 64;	/* entries per directory */
+	uint64_t minSize = 0;
+	uint64_t maxSize = 64 << 10;	/* file sizes are log uniform between the two */
+	unsigned xipPercent = 0;	/* of the pages, the rest is compressed */
+	unsigned byteAlignedPercent = 0;
+	unsigned entropyPercent = 50;	/* random bytes of each page, the others compress well */
+	uint64_t seed = 1;
+
+	static uint64_t mix(uint64_t x)
+	{
+		// splitmix64 finalizer
+		x += 0x9e3779b97f4a7c15ull;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+		return x ^ (x >> 31);
+	}
+
+	uint64_t pageType(uint64_t inode, uint64_t page) const
+	{
+		uint64_t roll = mix(seed ^ mix(inode ^ mix(page))) % 100;
+		if (roll < xipPercent)
+			return 0;
+		if (roll < xipPercent + byteAlignedPercent)
+			return 2;
+		return 1;
+	}
+
+	void fill(uint64_t inode, u8* data, uint64_t size) const
+	{
+		static const char text[] = "synthetic axfs page contents, repeated to compress. ";
+		for (uint64_t offset = 0; offset < size; offset += PAGE_CACHE_SIZE)
+		{
+			uint64_t length = std::min(size - offset, (uint64_t) PAGE_CACHE_SIZE);
+			uint64_t noise = length * entropyPercent / 100;
+			uint64_t state = mix(seed ^ mix(inode ^ mix(offset)));
+			uint64_t i = 0;
+			for (; i + 8 <= noise; i += 8)
+			{
+				state = mix(state);
+				memcpy(data + offset + i, &state, 8);
+			}
+			for (; i < length; ++i)
+				data[offset + i] = (u8) text[(offset + i) % (sizeof(text) - 1)];
+		}
+	}
+};
+
+// Turns a directory tree into an image, the job of mkfs.axfs.  Inodes are
+// numbered breadth first with the entries of each directory consecutive and
+// sorted, as lookup and readdir expect.  The output only depends on the tree
+// and the options, never on the number of threads.
+struct axfs_builder
+{
+	struct entry
+	{
+		std::string path;	/* on the host */
+		std::string imagePath;	/* relative to the root, as the profiler prints it */
+		std::string name;
+		uint64_t mode = 0;
+		uint64_t uid = 0;
+		uint64_t gid = 0;
+		uint64_t size = 0;
+		uint64_t arrayIndex = 0;	/* first child or first node */
+		uint64_t numEntries = 0;	/* children or nodes */
+	};
+
+	// a node already written, found again by the hash of its content
+	struct node
+	{
+		uint64_t type;
+		uint64_t index;
+		uint64_t length;
+	};
+
+	// a finished region waiting to be written
+	struct region
+	{
+		be64 axfs_super_onmedia::* descriptor;
+		const char* name;
+		std::vector<u8> data;
+		std::vector<u8> packed;	/* compressed data, empty if stored as is */
+		FILE* prefix = nullptr;	/* spilled payload that goes before data */
+		uint64_t prefixSize = 0;
+		uint64_t maxIndex = 0;
+		u8 depth = 0;
+		uint64_t offset = 0;
+	};
+
+	// Payload of a region that moves to a temporary file when memory runs short.
+	// The file becomes the region's prefix, followed by what is still in data.
+	struct spillable
+	{
+		std::vector<u8> data;	/* the bytes after the spilled ones */
+		FILE* file = nullptr;
+		uint64_t spilled = 0;
+		bool failed = false;	/* a write to file failed, its contents are lost */
+		bool noFile = false;	/* no temporary file could be made, data stays in memory */
+
+		~spillable()
+		{
+			if (file)
+				fclose(file);
+		}
+
+		uint64_t size() const
+		{
+			return spilled + data.size();
+		}
+
+		// the bytes at offset, nullptr once they are spilled
+		const u8* at(uint64_t offset) const
+		{
+			return offset < spilled ? nullptr : data.data() + (offset - spilled);
+		}
+
+		void spill(const char* name)
+		{
+			if (data.empty() || failed || noFile)
+				return;
+			if (!file)
+				file = tmpfile();
+			if (!file)
+			{
+				printf("%s: cannot create a spill file, keeping it in memory\n", name);
+				noFile = true;
+				return;
+			}
+			if (fwrite(data.data(), data.size(), 1, file) != 1)
+			{
+				printf("%s: spill file write failed\n", name);
+				failed = true;
+			}
+			spilled += data.size();
+			std::vector<u8>().swap(data);
+		}
+
+		void moveTo(region& r)
+		{
+			r.data.swap(data);
+			r.prefix = file;
+			r.prefixSize = spilled;
+		}
+	};
+
+	axfs_build_options options;
+	const axfs_compressor* compressor = nullptr;
+	std::vector<entry> entries;	/* in inode order */
+
+	std::vector<uint64_t> nodeType;
+	std::vector<uint64_t> nodeIndex;
+	std::vector<uint64_t> cnodeOffset;
+	std::vector<uint64_t> cnodeIndex;
+	std::vector<uint64_t> banodeOffset;
+	std::vector<uint64_t> cblockOffset;
+	std::vector<u8> cblockTags;
+	spillable xip;
+	spillable byteAligned;
+	spillable compressed;	/* cblocks that have been spilled */
+	std::vector<std::vector<u8>> cblocks;	/* raw until compressCblocks, empty once spilled */
+	std::vector<uint64_t> cblockRawSize;
+	std::vector<uint64_t> cblockPackedSize;
+	size_t compressedCblocks = 0;	/* cblocks before this one are compressed */
+	size_t spilledCblocks = 0;	/* and the ones before this have moved to compressed */
+	uint64_t heldBytes = 0;	/* raw bytes of the cblocks still to compress */
+	bool cblockBreak = false;	/* the next compressed page starts a new cblock */
+	const axfs_synthetic_options* synthetic = nullptr;	/* set by generate, the tree and contents are made up */
+	std::set<std::pair<std::string, uint64_t>> xipPages;	/* image path and page number */
+	std::unordered_map<uint64_t, std::vector<node>> nodesByHash;
+	uint64_t sharedPages = 0;
+	uint64_t sharedBytes = 0;
+
+	explicit axfs_builder(const axfs_build_options& options)
+		: options(options)
+	{ }
+
+#ifdef _WIN32
+	static void listDirectory(const std::string& dir, std::vector<entry>& children)
+	{
+		WIN32_FIND_DATAA data;
+		HANDLE find = FindFirstFileA((dir + "\\*").c_str(), &data);
+		if (find == INVALID_HANDLE_VALUE)
+			return;
+		do
+		{
+			if (strcmp(data.cFileName, ".") == 0 || strcmp(data.cFileName, "..") == 0)
+				continue;
+			entry e;
+			e.name = data.cFileName;
+			e.path = dir + "\\" + e.name;
+			bool isDir = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+			e.mode = isDir ? 0040755 : 0100644;
+			e.size = isDir ? 0 : ((uint64_t) data.nFileSizeHigh << 32) | data.nFileSizeLow;
+			children.push_back(e);
+		} while (FindNextFileA(find, &data));
+		FindClose(find);
+	}
+#else
+	static bool statEntry(entry& e)
+	{
+		struct stat st;
+		if (lstat(e.path.c_str(), &st) != 0)
+			return false;
+		e.mode = st.st_mode;
+		e.uid = st.st_uid;
+		e.gid = st.st_gid;
+		e.size = S_ISREG(e.mode) || S_ISLNK(e.mode) ? (uint64_t) st.st_size : 0;
+		if (S_ISCHR(e.mode) || S_ISBLK(e.mode))
+		{
+			// device numbers are kept in the size, in the kernel's old 8:8 encoding
+			unsigned devMajor = major(st.st_rdev), devMinor = minor(st.st_rdev);
+			if (devMajor > 0xff || devMinor > 0xff)
+				printf("%s: device %u:%u does not fit into 8:8 bits, truncated\n", e.path.c_str(), devMajor, devMinor);
+			e.size = (uint64_t)(devMajor & 0xff) << 8 | (devMinor & 0xff);
+		}
+		return true;
+	}
+
+	static void listDirectory(const std::string& dir, std::vector<entry>& children)
+	{
+		DIR* d = opendir(dir.c_str());
+		if (!d)
+		{
+			printf("%s: cannot open directory\n", dir.c_str());
+			return;
+		}
+		while (auto de = readdir(d))
+		{
+			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+				continue;
+			entry e;
+			e.name = de->d_name;
+			e.path = dir + "/" + e.name;
+			if (statEntry(e))
+				children.push_back(e);
+			else
+				printf("%s: cannot stat\n", e.path.c_str());
+		}
+		closedir(d);
+	}
+#endif
+
+	// number the inodes breadth first, each directory's entries sorted by name
+	bool scan(const char* root)
+	{
+		entry top;
+		top.path = root;
+		top.mode = 0040755;
+#ifndef _WIN32
+		struct stat st;
+		if (stat(root, &st) != 0 || !S_ISDIR(st.st_mode))
+		{
+			printf("%s: not a directory\n", root);
+			return false;
+		}
+		top.mode = st.st_mode;
+		top.uid = st.st_uid;
+		top.gid = st.st_gid;
+#endif
+		entries.push_back(top);
+
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			if (!S_ISDIR(entries[i].mode))
+				continue;
+			std::vector<entry> children;
+			listDirectory(entries[i].path, children);
+			std::sort(children.begin(), children.end(), [](const entry& a, const entry& b) {
+				return strcmp(a.name.c_str(), b.name.c_str()) < 0;
+			});
+			entries[i].arrayIndex = entries.size();
+			entries[i].numEntries = children.size();
+			for (auto& child : children)
+			{
+				child.imagePath = i == 0 ? child.name : entries[i].imagePath + "/" + child.name;
+				entries.push_back(std::move(child));
+			}
+		}
+		return true;
+	}
+
+	bool readContents(const entry& e, std::vector<u8>& data)
+	{
+		data.resize((size_t) e.size);
+		if (e.size == 0)
+			return true;
+		if (synthetic)
+		{
+			synthetic->fill(&e - entries.data(), data.data(), e.size);
+			return true;
+		}
+#ifndef _WIN32
+		if (S_ISLNK(e.mode))
+			return readlink(e.path.c_str(), (char*)data.data(), data.size()) == (ssize_t) e.size;
+#endif
+		FILE* file = nullptr;
+		fopen_s(&file, e.path.c_str(), "rb");
+		if (!file)
+			return false;
+		bool ok = fread(data.data(), data.size(), 1, file) == 1;
+		fclose(file);
+		return ok;
+	}
+
+	// Read the "path,offset,count" lines axfs_profiling.c prints for every page
+	// faulted through axfs_fault, which only sees read only mappings.  Counts of
+	// repeated lines add up.  With a budget the most used pages are kept, ties
+	// broken by path and offset so that the choice does not depend on line order.
+	bool loadXipProfile(const char* filename)
+	{
+		FILE* file = nullptr;
+		fopen_s(&file, filename, "rb");
+		if (!file)
+		{
+			printf("%s: cannot open profile\n", filename);
+			return false;
+		}
+
+		std::map<std::pair<std::string, uint64_t>, uint64_t> counts;
+		char line[4096];
+		uint64_t lineNumber = 0;
+		while (fgets(line, sizeof(line), file))
+		{
+			++lineNumber;
+			// the path may itself contain commas, the numbers are the last two fields
+			char* countField = strrchr(line, ',');
+			if (!countField)
+				continue;
+			*countField++ = 0;
+			char* offsetField = strrchr(line, ',');
+			if (!offsetField)
+			{
+				printf("%s:%" PRIu64 ": expected path,offset,count\n", filename, lineNumber);
+				continue;
+			}
+			*offsetField++ = 0;
+
+			const char* path = line;
+			while (path[0] == '.' && path[1] == '/')
+				path += 2;
+			uint64_t page = strtoull(offsetField, nullptr, 10) >> PAGE_SHIFT;
+			counts[std::make_pair(std::string(path), page)] += strtoull(countField, nullptr, 10);
+		}
+		fclose(file);
+
+		std::vector<std::pair<std::pair<std::string, uint64_t>, uint64_t>> hot(counts.begin(), counts.end());
+		std::stable_sort(hot.begin(), hot.end(), [](const decltype(hot)::value_type& a, const decltype(hot)::value_type& b) {
+			return a.second > b.second;
+		});
+		size_t keep = hot.size();
+		if (options.xipBudget)
+			keep = std::min(keep, (size_t)(options.xipBudget >> PAGE_SHIFT));
+		for (size_t i = 0; i < keep; ++i)
+			xipPages.insert(hot[i].first);
+
+		printf("%s: %" PRIu64 " profiled pages, %" PRIu64 " placed in xip\n", filename, (uint64_t) hot.size(), (uint64_t) keep);
+		return true;
+	}
+
+	// node type for page of a file, 0 XIP, 1 compressed or 2 byte aligned
+	uint64_t choosePageType(const entry& e, uint64_t page, uint64_t length) const
+	{
+		if (synthetic)
+			return synthetic->pageType(&e - entries.data(), page);
+		// only regular files are ever mapped, a symlink target is read through readpage
+		if (S_ISREG(e.mode) && xipPages.count(std::make_pair(e.imagePath, page)))
+			return 0;
+		if (length < PAGE_CACHE_SIZE && length <= options.tailLimit)
+			return 2;
+		return 1;
+	}
+
+	// FNV-1a over 64 bit words, the tail byte by byte
+	static uint64_t hashPage(const u8* data, uint64_t length)
+	{
+		uint64_t hash = 0xcbf29ce484222325ull;
+		uint64_t i = 0;
+		for (; i + 8 <= length; i += 8)
+		{
+			uint64_t word;
+			memcpy(&word, data + i, 8);
+			hash ^= word;
+			hash *= 0x100000001b3ull;
+		}
+		for (; i < length; ++i)
+		{
+			hash ^= data[i];
+			hash *= 0x100000001b3ull;
+		}
+		return hash ^ length;
+	}
+
+	// the raw content of a node, null once its cblock is compressed or it is spilled
+	const u8* nodeData(const node& n) const
+	{
+		switch (n.type)
+		{
+		case 0: return xip.at(n.index << PAGE_SHIFT);
+		case 1:
+		{
+			size_t cblock = (size_t) cnodeIndex[(size_t) n.index];
+			if (cblock < compressedCblocks)
+				return nullptr;
+			return cblocks[cblock].data() + cnodeOffset[(size_t) n.index];
+		}
+		default: return byteAligned.at(banodeOffset[(size_t) n.index]);
+		}
+	}
+
+	// point the page at an identical node of the same type if there is one,
+	// otherwise remember the node that add is about to create
+	bool shareNode(uint64_t type, const u8* data, uint64_t length)
+	{
+		auto& candidates = nodesByHash[hashPage(data, length)];
+		for (auto& n : candidates)
+		{
+			if (n.type != type || n.length != length)
+				continue;
+			const u8* existing = nodeData(n);
+			if (existing && memcmp(existing, data, (size_t) length) == 0)
+			{
+				nodeType.push_back(type);
+				nodeIndex.push_back(n.index);
+				++sharedPages;
+				sharedBytes += length;
+				return true;
+			}
+		}
+
+		node n;
+		n.type = type;
+		n.length = length;
+		switch (type)
+		{
+		case 0: n.index = xip.size() >> PAGE_SHIFT; break;
+		case 1: n.index = cnodeOffset.size(); break;
+		default: n.index = banodeOffset.size(); break;
+		}
+		candidates.push_back(n);
+		return false;
+	}
+
+	// raw page bytes held in memory, options.memoryLimit bounds them
+	uint64_t heldPayload() const
+	{
+		return heldBytes + xip.data.size() + byteAligned.data.size();
+	}
+
+	// xip and byte aligned pages can spill at any point, unlike an open cblock
+	void spillPages()
+	{
+		xip.spill("xip");
+		byteAligned.spill("byte_aligned");
+	}
+
+	void addXipPage(const u8* data, uint64_t length)
+	{
+		nodeType.push_back(0);
+		nodeIndex.push_back(xip.size() >> PAGE_SHIFT);
+		xip.data.insert(xip.data.end(), data, data + length);
+		xip.data.resize(xip.data.size() + (PAGE_CACHE_SIZE - length));
+		if (heldPayload() > options.memoryLimit)
+			spillPages();
+	}
+
+	void addByteAlignedPage(const u8* data, uint64_t length)
+	{
+		nodeType.push_back(2);
+		nodeIndex.push_back(banodeOffset.size());
+		banodeOffset.push_back(byteAligned.size());
+		byteAligned.data.insert(byteAligned.data.end(), data, data + length);
+		if (heldPayload() > options.memoryLimit)
+			spillPages();
+	}
+
+	// append to the current cblock, starting a new one when the page does not fit
+	// or packCblocks asked for a break
+	void addCompressedPage(const u8* data, uint64_t length)
+	{
+		if (cblocks.empty() || cblockBreak || cblocks.back().size() + length > options.cblockSize)
+		{
+			// every cblock held is complete at this point
+			if (heldPayload() > options.memoryLimit)
+			{
+				spillCblocks();
+				spillPages();
+			}
+			cblocks.push_back(std::vector<u8>());
+			cblockRawSize.push_back(0);
+		}
+		cblockBreak = false;
+		cblockRawSize.back() += length;
+		heldBytes += length;
+		auto& cblock = cblocks.back();
+		nodeType.push_back(1);
+		nodeIndex.push_back(cnodeOffset.size());
+		cnodeOffset.push_back(cblock.size());
+		cnodeIndex.push_back(cblocks.size() - 1);
+		cblock.insert(cblock.end(), data, data + length);
+	}
+
+	// Decide where a file with this many bytes of compressed pages starts.  Small
+	// files keep filling the current cblock, so the files of a directory share
+	// blocks in readdir order, unless straddling a boundary would cost the file
+	// an extra inflate.  A file of a cblock or more gets blocks to itself, no
+	// neighbour's pages are inflated with it and none of its pages with theirs.
+	void packCblocks(uint64_t bytes)
+	{
+		if (!options.localityPacking || bytes == 0)
+			return;
+		uint64_t size = options.cblockSize;
+		if (bytes >= size)
+		{
+			cblockBreak = true;
+			return;
+		}
+		uint64_t used = cblocks.empty() || cblockBreak ? 0 : cblocks.back().size();
+		if (used && used + bytes > size)
+			cblockBreak = true;
+	}
+
+	// Inflates needed to read each file once with a cold cache, against the
+	// fewest its compressed bytes could need, and the raw cblock bytes that
+	// inflating them produces against the bytes the file actually uses.
+	void reportPacking() const
+	{
+		uint64_t files = 0, inflates = 0, ideal = 0, inflated = 0, consumed = 0;
+		std::vector<uint64_t> touched;
+		for (auto& e : entries)
+		{
+			if (S_ISDIR(e.mode))
+				continue;
+			touched.clear();
+			uint64_t bytes = 0;
+			for (uint64_t i = e.arrayIndex; i < e.arrayIndex + e.numEntries; ++i)
+			{
+				if (nodeType[(size_t) i] != 1)
+					continue;
+				touched.push_back(cnodeIndex[(size_t) nodeIndex[(size_t) i]]);
+				bytes += std::min(e.size - ((i - e.arrayIndex) << PAGE_SHIFT), (uint64_t) PAGE_CACHE_SIZE);
+			}
+			if (touched.empty())
+				continue;
+			std::sort(touched.begin(), touched.end());
+			touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+			++files;
+			inflates += touched.size();
+			ideal += (bytes + options.cblockSize - 1) / options.cblockSize;
+			for (auto cblock : touched)
+				inflated += cblockRawSize[(size_t) cblock];
+			consumed += bytes;
+		}
+		if (files)
+			printf("packing: %" PRIu64 " files with compressed pages, %.2f inflates per file read (%.2f at best), %.2fx the bytes used inflated\n",
+				files, (double) inflates / files, (double) ideal / files, consumed ? (double) inflated / consumed : 0.0);
+	}
+
+	// give every page of every file a node, in inode order
+	bool layout()
+	{
+		std::vector<u8> data;
+		uint64_t placed = 0;
+		for (auto& e : entries)
+		{
+			if (S_ISDIR(e.mode))
+				continue;
+			e.arrayIndex = nodeType.size();
+			if (!S_ISREG(e.mode) && !S_ISLNK(e.mode))
+				continue; // the size of a device is its number, there are no pages
+			e.numEntries = (e.size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+			if (!readContents(e, data))
+			{
+				printf("%s: cannot read\n", e.path.c_str());
+				return false;
+			}
+			uint64_t compressedBytes = 0;
+			for (uint64_t page = 0; page < e.numEntries; ++page)
+			{
+				uint64_t length = std::min(e.size - (page << PAGE_SHIFT), (uint64_t) PAGE_CACHE_SIZE);
+				if (choosePageType(e, page, length) == 1)
+					compressedBytes += length;
+			}
+			packCblocks(compressedBytes);
+
+			for (uint64_t page = 0; page < e.numEntries; ++page)
+			{
+				const u8* chunk = data.data() + (page << PAGE_SHIFT);
+				uint64_t length = std::min(e.size - (page << PAGE_SHIFT), (uint64_t) PAGE_CACHE_SIZE);
+				uint64_t type = choosePageType(e, page, length);
+				placed += type == 0;
+				if (options.dedupe && shareNode(type, chunk, length))
+					continue;
+				switch (type)
+				{
+				case 0: addXipPage(chunk, length); break;
+				case 1: addCompressedPage(chunk, length); break;
+				case 2: addByteAlignedPage(chunk, length); break;
+				}
+			}
+			// and nothing else shares the last block of a large file
+			if (compressedBytes >= options.cblockSize)
+				cblockBreak = options.localityPacking;
+		}
+
+		if (placed < xipPages.size())
+			printf("%" PRIu64 " profiled pages are not in the tree or not in a regular file\n", (uint64_t)(xipPages.size() - placed));
+		if (sharedPages)
+			printf("dedupe: %" PRIu64 " pages share a node, %" PRIu64 " bytes saved\n", sharedPages, sharedBytes);
+		nodesByHash.clear();
+		reportPacking();
+		return true;
+	}
+
+	// compress one cblock in place, or leave it raw if tags allow and it did not shrink
+	void compressCblock(size_t i, std::vector<u8>& scratch)
+	{
+		auto& raw = cblocks[i];
+		scratch.resize(raw.size() + AXFS_COMPRESS_SLACK(raw.size()));
+		int level = options.level >= 0 ? options.level : compressor->defaultLevel;
+		auto len = compressor->encode(scratch.data(), scratch.size(), raw.data(), raw.size(), level);
+		if (options.perCblockCodec && (len < 0 || (uint64_t) len >= raw.size()))
+		{
+			cblockTags[i] = AXFS_COMPRESSION_STORED;
+			return;
+		}
+		assert(len >= 0);
+		cblockTags[i] = compressor->type;
+		raw.assign(scratch.begin(), scratch.begin() + (size_t) len);
+	}
+
+	// compress the cblocks from compressedCblocks up to end
+	void compressCblocks(size_t end)
+	{
+		cblockTags.resize(cblocks.size(), compressor->type);
+		cblockPackedSize.resize(cblocks.size(), 0);
+		axfs_work_pool pool(options.threads);
+		for (size_t first = compressedCblocks; first < end; first += AXFS_BUILD_TASK_CBLOCKS)
+		{
+			pool.push([this, first, end] {
+				std::vector<u8> scratch;
+				size_t last = std::min(first + AXFS_BUILD_TASK_CBLOCKS, end);
+				for (size_t i = first; i < last; ++i)
+				{
+					compressCblock(i, scratch);
+					cblockPackedSize[i] = cblocks[i].size();
+				}
+			});
+		}
+		pool.run();
+		compressedCblocks = end;
+		heldBytes = 0;
+	}
+
+	// Bound the memory of big images: compress every cblock held so far and move
+	// it to a temporary file that is copied into the compressed region at the
+	// end, as spillPages does with xip and byte aligned pages.  The pages of
+	// spilled cblocks and nodes can no longer be shared by dedupe.
+	void spillCblocks()
+	{
+		compressCblocks(cblocks.size());
+		for (; spilledCblocks < cblocks.size(); ++spilledCblocks)
+		{
+			auto& cblock = cblocks[spilledCblocks];
+			compressed.data.insert(compressed.data.end(), cblock.begin(), cblock.end());
+			std::vector<u8>().swap(cblock);
+		}
+		compressed.spill("compressed");
+	}
+
+	// planar bytetable with just enough bytes per entry for the largest value,
+	// or minDepth if that is more
+	static void encodeTable(const std::vector<uint64_t>& values, region& r, u8 minDepth = 1)
+	{
+		uint64_t largest = 0;
+		for (auto v : values)
+			largest = std::max(largest, v);
+		u8 depth = std::max(minDepth, (u8) 1);
+		while (depth < 8 && largest >> (8 * depth))
+			++depth;
+
+		size_t count = std::max(values.size(), (size_t) 1);
+		r.data.assign(count * depth, 0);
+		for (size_t i = 0; i < values.size(); ++i)
+		{
+			for (u8 b = 0; b < depth; ++b)
+				r.data[b * count + i] = (u8)(values[i] >> (8 * b));
+		}
+		r.maxIndex = values.size();
+		r.depth = depth;
+	}
+
+	bool selectCompressor()
+	{
+		compressor = axfs_find_compressor(options.compressionType);
+		if (!compressor)
+			printf("no compressor built in for %s\n", axfs_compression_name(options.compressionType));
+		return compressor != nullptr;
+	}
+
+	bool write(const char* filename)
+	{
+		compressCblocks(cblocks.size());
+		cblockOffset.assign(1, 0);
+		for (auto size : cblockPackedSize)
+			cblockOffset.push_back(cblockOffset.back() + size);
+
+		// strings and the per inode tables
+		std::vector<uint64_t> fileSize, nameOffset, numEntries, modeIndex, arrayIndex;
+		std::vector<uint64_t> modes, uids, gids;
+		std::map<std::tuple<uint64_t, uint64_t, uint64_t>, uint64_t> modeIndices;
+		std::vector<u8> strings;
+		for (auto& e : entries)
+		{
+			fileSize.push_back(e.size);
+			nameOffset.push_back(strings.size());
+			strings.insert(strings.end(), e.name.begin(), e.name.end());
+			strings.push_back(0);
+			numEntries.push_back(e.numEntries);
+			arrayIndex.push_back(e.arrayIndex);
+			auto key = std::make_tuple(e.mode, e.uid, e.gid);
+			auto found = modeIndices.find(key);
+			if (found == modeIndices.end())
+			{
+				found = modeIndices.insert(std::make_pair(key, (uint64_t) modes.size())).first;
+				modes.push_back(e.mode);
+				uids.push_back(e.uid);
+				gids.push_back(e.gid);
+			}
+			modeIndex.push_back(found->second);
+		}
+
+		for (size_t i = spilledCblocks; i < cblocks.size(); ++i)
+			compressed.data.insert(compressed.data.end(), cblocks[i].begin(), cblocks[i].end());
+		cblocks.clear();
+		if (xip.failed || byteAligned.failed || compressed.failed)
+			return false;
+
+		// xip first so that it is page aligned and starts the memory mapped part
+		std::vector<region> regions(options.perCblockCodec ? 19 : 18);
+		regions[0].descriptor = &axfs_super_onmedia::xip;
+		regions[0].name = "xip";
+		xip.moveTo(regions[0]);
+		regions[1].descriptor = &axfs_super_onmedia::strings;
+		regions[1].name = "strings";
+		regions[1].data.swap(strings);
+		regions[2].descriptor = &axfs_super_onmedia::byte_aligned;
+		regions[2].name = "byte_aligned";
+		byteAligned.moveTo(regions[2]);
+		regions[3].descriptor = &axfs_super_onmedia::compressed;
+		regions[3].name = "compressed";
+		compressed.moveTo(regions[3]);
+
+		struct table
+		{
+			be64 axfs_super_onmedia::* descriptor;
+			const char* name;
+			const std::vector<uint64_t>* values;
+			u8 planes;	/* the kernel keeps this many plane pointers, axfs_metadata_ptrs_incore */
+		};
+		std::vector<u64> tags(cblockTags.begin(), cblockTags.end());
+		const table tables[] = {
+			{ &axfs_super_onmedia::node_type, "node_type", &nodeType, 1 },
+			{ &axfs_super_onmedia::node_index, "node_index", &nodeIndex, 8 },
+			{ &axfs_super_onmedia::cnode_offset, "cnode_offset", &cnodeOffset, 4 },
+			{ &axfs_super_onmedia::cnode_index, "cnode_index", &cnodeIndex, 8 },
+			{ &axfs_super_onmedia::banode_offset, "banode_offset", &banodeOffset, 8 },
+			{ &axfs_super_onmedia::cblock_offset, "cblock_offset", &cblockOffset, 8 },
+			{ &axfs_super_onmedia::inode_file_size, "inode_file_size", &fileSize, 8 },
+			{ &axfs_super_onmedia::inode_name_offset, "inode_name_offset", &nameOffset, 8 },
+			{ &axfs_super_onmedia::inode_num_entries, "inode_num_entries", &numEntries, 8 },
+			{ &axfs_super_onmedia::inode_mode_index, "inode_mode_index", &modeIndex, 8 },
+			{ &axfs_super_onmedia::inode_array_index, "inode_array_index", &arrayIndex, 8 },
+			{ &axfs_super_onmedia::modes, "modes", &modes, 4 },
+			{ &axfs_super_onmedia::uids, "uids", &uids, 4 },
+			{ &axfs_super_onmedia::gids, "gids", &gids, 4 },
+		};
+		size_t next = 4;
+		for (auto& t : tables)
+		{
+			regions[next].descriptor = t.descriptor;
+			regions[next].name = t.name;
+			encodeTable(*t.values, regions[next++], std::min(options.minTableDepth, t.planes));
+		}
+		if (options.perCblockCodec)
+		{
+			regions[next].name = "cblock_codec";
+			encodeTable(tags, regions[next++]);
+		}
+
+		if (options.compressMetadata)
+			compressMetadata(regions);
+
+		return writeImage(filename, regions);
+	}
+
+	// compress strings and the tables, keeping whichever is smaller
+	void compressMetadata(std::vector<region>& regions)
+	{
+		// per cblock images keep their metadata in zlib, see AXFS_COMPRESSION_PER_CBLOCK
+		auto metadata = options.perCblockCodec ? axfs_find_compressor(AXFS_COMPRESSION_ZLIB) : compressor;
+		if (!metadata || metadata->type == AXFS_COMPRESSION_STORED)
+			return;
+		int level = options.level >= 0 && metadata == compressor ? options.level : metadata->defaultLevel;
+
+		axfs_work_pool pool(options.threads);
+		for (auto& r : regions)
+		{
+			if (r.name == std::string("xip") || r.name == std::string("byte_aligned") || r.name == std::string("compressed") || r.data.empty())
+				continue;
+			region* target = &r;
+			pool.push([target, metadata, level] {
+				target->packed.resize(target->data.size() + AXFS_COMPRESS_SLACK(target->data.size()));
+				auto len = metadata->encode(target->packed.data(), target->packed.size(), target->data.data(), target->data.size(), level);
+				if (len < 0 || (uint64_t) len >= target->data.size())
+					len = 0;
+				target->packed.resize((size_t) len);
+			});
+		}
+		pool.run();
+	}
+
+	bool writeImage(const char* filename, std::vector<region>& regions)
+	{
+		// superblock and descriptors, then the regions, xip on a page boundary
+		uint64_t offset = sizeof(axfs_super_onmedia) + regions.size() * sizeof(axfs_region_desc_onmedia);
+		for (auto& r : regions)
+		{
+			uint64_t align = r.descriptor == &axfs_super_onmedia::xip ? PAGE_CACHE_SIZE : 8;
+			offset = (offset + align - 1) & ~(align - 1);
+			r.offset = offset;
+			offset += r.prefixSize + (r.packed.empty() ? r.data.size() : r.packed.size());
+		}
+		uint64_t imageSize = offset;
+
+		std::vector<u8> header((size_t) regions[0].offset, 0);
+		axfs_super_onmedia* super = (axfs_super_onmedia*) header.data();
+		super->magic.set(0x48A0E4CD);
+		memcpy(super->signature, "Advanced XIP FS", 16);
+		super->cblock_size.set(options.cblockSize);
+		super->files.set(entries.size());
+		super->size.set(imageSize);
+		super->blocks.set(nodeType.size());
+		uint64_t xipSize = regions[0].prefixSize + regions[0].data.size();
+		super->mmap_size.set(xipSize ? regions[0].offset + xipSize : 0);
+		super->version_major = 2;
+		super->version_minor = 0;
+		super->version_sub = 0;
+		super->compression_type = options.perCblockCodec ? AXFS_COMPRESSION_PER_CBLOCK : options.compressionType;
+		super->timestamp.set(options.timestamp);
+		super->page_shift = PAGE_SHIFT;
+
+		uint64_t descriptorOffset = sizeof(axfs_super_onmedia);
+		for (auto& r : regions)
+		{
+			if (r.descriptor)
+				(super->*r.descriptor).set(descriptorOffset);
+			else
+				super->cblock_codec.set((uint32_t) descriptorOffset);
+
+			axfs_region_desc_onmedia* desc = (axfs_region_desc_onmedia*)(header.data() + descriptorOffset);
+			desc->fsoffset.set(r.offset);
+			desc->size.set(r.prefixSize + r.data.size());
+			desc->compressed_size.set(r.packed.size());
+			desc->max_index.set(r.maxIndex);
+			desc->table_byte_depth = r.depth;
+			desc->incore = 0;
+			descriptorOffset += sizeof(axfs_region_desc_onmedia);
+		}
 
-inline uint64_t byteswap(uint64_t v)
-{
-	return _byteswap_uint64(v);
-}
+		FILE* file = nullptr;
+		fopen_s(&file, filename, "wb");
+		if (!file)
+		{
+			printf("%s: cannot create\n", filename);
+			return false;
+		}
+		bool ok = fwrite(header.data(), header.size(), 1, file) == 1;
+		uint64_t position = header.size();
+		static const u8 zeros[PAGE_CACHE_SIZE] = {};
+		for (auto& r : regions)
+		{
+			ok = ok && (r.offset == position || fwrite(zeros, (size_t)(r.offset - position), 1, file) == 1);
+			ok = ok && copyPrefix(r, file);
+			auto& payload = r.packed.empty() ? r.data : r.packed;
+			ok = ok && (payload.empty() || fwrite(payload.data(), payload.size(), 1, file) == 1);
+			position = r.offset + r.prefixSize + payload.size();
+			printf("%-18s %10" PRIu64 " bytes%s\n", r.name, r.prefixSize + r.data.size(),
+				r.packed.empty() ? "" : (" packed to " + std::to_string(r.packed.size())).c_str());
+		}
+		ok = fclose(file) == 0 && ok;
 
-// wrapper for reading big-ending values
-template<typename T>
-struct BigEndianInt
-{
-	T value;
+		printf("%s: %" PRIu64 " inodes, %" PRIu64 " nodes, %" PRIu64 " cblocks, %" PRIu64 " bytes\n", filename,
+			(uint64_t) entries.size(), (uint64_t) nodeType.size(), (uint64_t) cblockTags.size(), imageSize);
+		return ok;
+	}
 
-	operator T() const
+	static bool copyPrefix(const region& r, FILE* file)
 	{
-		return byteswap(value);
+		if (!r.prefix)
+			return true;
+		rewind(r.prefix);
+		std::vector<u8> chunk(1 << 20);
+		for (uint64_t left = r.prefixSize; left > 0;)
+		{
+			size_t len = (size_t) std::min(left, (uint64_t) chunk.size());
+			if (fread(chunk.data(), len, 1, r.prefix) != 1 || fwrite(chunk.data(), len, 1, file) != 1)
+				return false;
+			left -= len;
+		}
+		return true;
 	}
-};
 
-typedef BigEndianInt<uint32_t> __be32;
-typedef BigEndianInt<uint64_t> __be64;
-typedef uint8_t u8;
-typedef uint64_t u64;
-
-#define	S_ISDIR(m)	((m & 0170000) == 0040000)	/* directory */
-#define	S_ISCHR(m)	((m & 0170000) == 0020000)	/* char special */
-#define	S_ISBLK(m)	((m & 0170000) == 0060000)	/* block special */
-#define	S_ISREG(m)	((m & 0170000) == 0100000)	/* regular file */
-#define	S_ISFIFO(m)	((m & 0170000) == 0010000)	/* fifo */
-#ifndef _POSIX_SOURCE
-#define	S_ISLNK(m)	((m & 0170000) == 0120000)	/* symbolic link */
-#define	S_ISSOCK(m)	((m & 0170000) == 0140000)	/* socket */
-#endif
+	// number a made up tree breadth first, fanout entries per directory and the
+	// files all on the last level, named so that sorting keeps their order
+	void generateTree(const axfs_synthetic_options& synth)
+	{
+		synthetic = &synth;
+		uint64_t fanout = std::max(synth.fanout, (uint64_t) 2);
+		std::vector<uint64_t> levels(1, synth.files);
+		while (levels.back() > fanout)
+			levels.push_back((levels.back() + fanout - 1) / fanout);
+		levels.push_back(1);
+		std::reverse(levels.begin(), levels.end());
 
-#define PAGE_SHIFT 12
-#define PAGE_CACHE_SHIFT 12
-#define PAGE_CACHE_SIZE (1<<PAGE_CACHE_SHIFT)
+		int digits = 1;
+		while (digits < 16 && (fanout - 1) >> (4 * digits))
+			++digits;
 
-/* on media format for the super block */
-struct axfs_super_onmedia
-{
-	__be32 magic;		/* 0x48A0E4CD - random number */
-	u8 signature[16];	/* "Advanced XIP FS" */
-	u8 digest[40];		/* sha1 digest for checking data integrity */
-	__be32 cblock_size;	/* maximum size of the block being compressed */
-	__be64 files;		/* number of inodes/files in fs */
-	__be64 size;		/* total image size */
-	__be64 blocks;		/* number of nodes in fs */
-	__be64 mmap_size;	/* size of the memory mapped part of image */
-	__be64 strings;		/* offset to strings region descriptor */
-	__be64 xip;		/* offset to xip region descriptor */
-	__be64 byte_aligned;	/* offset to the byte aligned region desc */
-	__be64 compressed;	/* offset to the compressed region desc */
-	__be64 node_type;	/* offset to node type region desc */
-	__be64 node_index;	/* offset to node index region desc */
-	__be64 cnode_offset;	/* offset to cnode offset region desc */
-	__be64 cnode_index;	/* offset to cnode index region desc */
-	__be64 banode_offset;	/* offset to banode offset region desc */
-	__be64 cblock_offset;	/* offset to cblock offset region desc */
-	__be64 inode_file_size;	/* offset to inode file size desc */
-	__be64 inode_name_offset;	/* offset to inode num_entries region desc */
-	__be64 inode_num_entries;	/* offset to inode num_entries region desc */
-	__be64 inode_mode_index;	/* offset to inode mode index region desc */
-	__be64 inode_array_index;	/* offset to inode node index region desc */
-	__be64 modes;		/* offset to mode mode region desc */
-	__be64 uids;		/* offset to mode uid index region desc */
-	__be64 gids;		/* offset to mode gid index region desc */
-	u8 version_major;
-	u8 version_minor;
-	u8 version_sub;
-	u8 compression_type;	/* Identifies type of compression used on FS */
-	__be64 timestamp;	/* UNIX time_t of filesystem build time */
-	u8 page_shift;
-};
+		std::mt19937_64 random(synth.seed);
+		double low = log((double) synth.minSize + 1);
+		double high = log((double) std::max(synth.maxSize, synth.minSize) + 1);
+		uint64_t first = 0;
+		for (size_t level = 0; level < levels.size(); ++level)
+		{
+			bool files = level + 1 == levels.size();
+			uint64_t next = first + levels[level];
+			for (uint64_t i = 0; i < levels[level]; ++i)
+			{
+				entry e;
+				e.mode = files ? 0100644 : 0040755;
+				if (level > 0)
+				{
+					// f or d and i % fanout in digits hex digits, zero padded
+					e.name.assign(1 + digits, '0');
+					e.name[0] = files ? 'f' : 'd';
+					for (uint64_t v = i % fanout, d = digits; v; v >>= 4, --d)
+						e.name[d] = "0123456789abcdef"[v & 15];
+				}
+				if (files)
+				{
+					double u = (random() >> 11) * (1.0 / 9007199254740992.0);
+					e.size = (uint64_t)(exp(low + u * (high - low)) - 1);
+				}
+				else
+				{
+					e.arrayIndex = next + i * fanout;
+					e.numEntries = std::min(fanout, levels[level + 1] - i * fanout);
+				}
+				entries.push_back(std::move(e));
+			}
+			first = next;
+		}
+		printf("synthetic tree: %" PRIu64 " inodes, %" PRIu64 " files on level %" PRIu64 "\n", (uint64_t) entries.size(), synth.files, (uint64_t)(levels.size() - 1));
+	}
 
-struct axfs_region_desc_onmedia
-{
-	__be64 fsoffset;
-	__be64 size;
-	__be64 compressed_size;
-	__be64 max_index;
-	u8 table_byte_depth;
-	u8 incore;
+	bool generate(const axfs_synthetic_options& synth, const char* filename)
+	{
+		if (!selectCompressor())
+			return false;
+		generateTree(synth);
+		return layout() && write(filename);
+	}
+
+	bool build(const char* root, const char* filename)
+	{
+		if (!selectCompressor())
+			return false;
+		if (!options.xipProfile.empty() && !loadXipProfile(options.xipProfile.c_str()))
+			return false;
+		return scan(root) && layout() && write(filename);
+	}
 };
 
-struct axfs_region : public axfs_region_desc_onmedia
+#ifdef AXFS_HAVE_FUSE
+#define AXFS_FUSE_TIMEOUT 86400.0	/* seconds the kernel may trust entries and attributes, images never change */
+
+// FUSE low level server on top of the reader, a port of the kernel module's
+// lookup, readdir and readpage.  FUSE inode numbers are axfs inode numbers
+// plus one, FUSE_ROOT_ID being the root.  fuse_session_loop_mt serves requests
+// on several threads, all sharing the image mapping and the cblock cache.
+// Files keep their page cache across opens as nothing ever changes.
+struct axfs_fuse
 {
-	void* data;
+	axfs& fs;
 
-	axfs_region()
-		: data(nullptr)
+	explicit axfs_fuse(axfs& fs)
+		: fs(fs)
 	{ }
 
-	~axfs_region()
+	static axfs& image(fuse_req_t req)
 	{
-		free(data);
+		return ((axfs_fuse*) fuse_req_userdata(req))->fs;
 	}
 
-	uint64_t axfs_bytetable_stitch(uint64_t index) const
+	static uint64_t toId(fuse_ino_t ino)
 	{
-		assert(index < max_index);
+		return ino - FUSE_ROOT_ID;
+	}
 
-		// This is the old v1.9.1 AXFS version of axfs_bytetable_stitch
-		const u8 *table = (const u8*)data;
-		uint64_t output = 0;
-		const uint64_t split = size / table_byte_depth;
+	static fuse_ino_t toIno(uint64_t id)
+	{
+		return (fuse_ino_t)(id + FUSE_ROOT_ID);
+	}
 
-		for (int i = 0; i < table_byte_depth; i++)
+	// as axfs_create_vfs_inode, times are all 0 and the link count 1
+	static void fillStat(const axfs& fs, uint64_t id, struct stat& st)
+	{
+		memset(&st, 0, sizeof(st));
+		uint64_t mode = fs.getMode(id);
+		uint64_t size = fs.getFileSize(id);
+		st.st_ino = toIno(id);
+		st.st_mode = (mode_t) mode;
+		st.st_nlink = 1;
+		st.st_uid = (uid_t) fs.getUid(id);
+		st.st_gid = (gid_t) fs.getGid(id);
+		st.st_blksize = PAGE_CACHE_SIZE;
+		if (S_ISREG(mode) || S_ISDIR(mode) || S_ISLNK(mode))
+		{
+			st.st_size = (off_t) size;
+			st.st_blocks = (blkcnt_t)(((size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT) * (PAGE_CACHE_SIZE / 512));
+		}
+		else
 		{
-			auto j = index + i * split;
-			auto bits = 8 * i;
-			uint64_t byte = table[j];
-			output += byte << bits;
+			// device numbers are kept in the size, old_decode_dev style
+			st.st_rdev = makedev((unsigned)(size >> 8) & 0xff, (unsigned) size & 0xff);
 		}
-		return output;
 	}
 
-};
-
-
+	static void init(void*, struct fuse_conn_info* conn)
+	{
+#ifdef FUSE_CAP_CACHE_SYMLINKS
+		if (conn->capable & FUSE_CAP_CACHE_SYMLINKS)
+			conn->want |= FUSE_CAP_CACHE_SYMLINKS;
+#endif
+		(void) conn;
+	}
 
-void loadRegionImpl(const char* name, axfs_region& region, FILE* file, uint64_t offset)
-{
-	fseek(file, (long) offset, SEEK_SET);
-	fread(&region, sizeof(axfs_region_desc_onmedia), 1, file);
+	// a missing name is answered with inode 0 so that the kernel caches the miss too
+	static void lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+	{
+		axfs& fs = image(req);
+		uint64_t dir = toId(parent);
+		if (!S_ISDIR(fs.getMode(dir)))
+		{
+			fuse_reply_err(req, ENOTDIR);
+			return;
+		}
 
-	printf("loadRegion %s: %lld bytes at %lld %dx%d\n", name, (uint64_t)region.size, (uint64_t)region.fsoffset, (uint32_t) region.max_index, (uint32_t) region.table_byte_depth);
-	assert(region.compressed_size == 0); // not implemented
+		fuse_entry_param entry;
+		memset(&entry, 0, sizeof(entry));
+		entry.entry_timeout = AXFS_FUSE_TIMEOUT;
+		uint64_t id = fs.lookupEntry(dir, name, strlen(name));
+		if (id != AXFS_NO_INODE)
+		{
+			entry.ino = toIno(id);
+			entry.attr_timeout = AXFS_FUSE_TIMEOUT;
+			fillStat(fs, id, entry.attr);
+		}
+		fuse_reply_entry(req, &entry);
+	}
 
-	region.data = malloc((size_t) region.size);
-	fseek(file, (long) region.fsoffset, SEEK_SET);
-	fread(region.data,  (size_t) region.size, 1, file);
-}
+	static void getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info*)
+	{
+		struct stat st;
+		fillStat(image(req), toId(ino), st);
+		fuse_reply_attr(req, &st, AXFS_FUSE_TIMEOUT);
+	}
 
-#define loadRegion(region, file, offset) loadRegionImpl(#region, region, file, offset)
+	static void readlink(fuse_req_t req, fuse_ino_t ino)
+	{
+		axfs& fs = image(req);
+		uint64_t id = toId(ino);
+		if (!S_ISLNK(fs.getMode(id)))
+		{
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		std::string target((size_t) fs.getFileSize(id), 0);
+		if (!fs.readFile(id, &target[0], 0, target.size()))
+		{
+			fuse_reply_err(req, EIO);
+			return;
+		}
+		fuse_reply_readlink(req, target.c_str());
+	}
 
-struct axfs
-{
-	axfs_super_onmedia superblock;
-	axfs_region strings;
-	axfs_region xip;
-	axfs_region compressed;
-	axfs_region byte_aligned;
-	axfs_region node_type;
-	axfs_region node_index;
-	axfs_region cnode_offset;
-	axfs_region cnode_index;
-	axfs_region banode_offset;
-	axfs_region cblock_offset;
-	axfs_region inode_file_size;
-	axfs_region inode_name_offset;
-	axfs_region inode_num_entries;
-	axfs_region inode_mode_index;
-	axfs_region inode_array_index;
-	axfs_region modes;
-	axfs_region uids;
-	axfs_region gids;
-
-	void* cblock_buffer = nullptr;
-	mutable uint64_t cachedBlock = (uint64_t)-1;
-
-	~axfs()
-	{
-		free(cblock_buffer);
-	}
-
-	void load(const char* filename)
+	static void open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
 	{
-		FILE* file = nullptr;
-		auto result = fopen_s(&file, filename, "rb");
-		assert(file);
-		fread(&superblock, sizeof(superblock), 1, file);
-		assert(superblock.magic == 0x48A0E4CD);
-		assert(superblock.compression_type == 0); // ZLIB
-
-		loadRegion(xip, file, superblock.xip);
-		loadRegion(strings, file, superblock.strings);
-		loadRegion(compressed, file, superblock.compressed);
-		loadRegion(byte_aligned, file, superblock.byte_aligned);
-		loadRegion(node_type, file, superblock.node_type);
-		loadRegion(node_index, file, superblock.node_index);
-		loadRegion(cnode_offset, file, superblock.cnode_offset);
-		loadRegion(cnode_index, file, superblock.cnode_index);
-		loadRegion(banode_offset, file, superblock.banode_offset);
-		loadRegion(cblock_offset, file, superblock.cblock_offset);
-		loadRegion(inode_file_size, file, superblock.inode_file_size);
-		loadRegion(inode_name_offset, file, superblock.inode_name_offset);
-		loadRegion(inode_num_entries, file, superblock.inode_num_entries);
-		loadRegion(inode_mode_index, file, superblock.inode_mode_index);
-		loadRegion(inode_array_index, file, superblock.inode_array_index);
-		loadRegion(modes, file, superblock.modes);
-		loadRegion(uids, file, superblock.uids);
-		loadRegion(gids, file, superblock.gids);
+		if (S_ISDIR(image(req).getMode(toId(ino))))
+			fuse_reply_err(req, EISDIR);
+		else if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			fuse_reply_err(req, EROFS);
+		else
+		{
+			fi->keep_cache = 1;
+			fuse_reply_open(req, fi);
+		}
+	}
 
-		fclose(file);
+	// reply straight from the spans of the file, XIP and byte aligned pages are
+	// sent from the image mapping and compressed ones from the cache
+	static void read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info*)
+	{
+		axfs_span_reader reader(image(req), toId(ino), (uint64_t) off, size);
+		std::vector<axfs_span> spans;
+		axfs_span span;
+		while (reader.next(span))
+			spans.push_back(span);
+		if (reader.failed)
+		{
+			fuse_reply_err(req, EIO);
+			return;
+		}
+		if (spans.empty())
+		{
+			fuse_reply_buf(req, nullptr, 0);
+			return;
+		}
 
-		printf("%lld files\n", (uint64_t)superblock.files);
-		printf("version %d.%d.%d\n", superblock.version_major, superblock.version_minor, superblock.version_sub);
+		std::vector<u8> storage(sizeof(fuse_bufvec) + (spans.size() - 1) * sizeof(fuse_buf));
+		fuse_bufvec* bufv = (fuse_bufvec*) storage.data();
+		bufv->count = spans.size();
+		bufv->idx = 0;
+		bufv->off = 0;
+		for (size_t i = 0; i < spans.size(); ++i)
+		{
+			fuse_buf& buf = bufv->buf[i];
+			memset(&buf, 0, sizeof(buf));
+			buf.size = (size_t) spans[i].length;
+			buf.mem = (void*) spans[i].data;
+			buf.fd = -1;
+		}
+		// the reply is written before this returns, the spans hold their cblocks until then
+		fuse_reply_data(req, bufv, FUSE_BUF_NO_SPLICE);
+	}
 
-		cblock_buffer = malloc(superblock.cblock_size);
+	static void opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+	{
+		if (!S_ISDIR(image(req).getMode(toId(ino))))
+		{
+			fuse_reply_err(req, ENOTDIR);
+			return;
+		}
+		fi->keep_cache = 1;
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 5)
+		fi->cache_readdir = 1;
+#endif
+		fuse_reply_open(req, fi);
 	}
 
-	const char* getName(uint64_t id) const
+	// as axfs_readdir the offset is the index into the directory, there are no
+	// "." and ".." entries
+	static void readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info*)
 	{
-		auto offset = inode_name_offset.axfs_bytetable_stitch(id);
-		return (const char*)((const u8*)strings.data + offset);
-	};
+		axfs& fs = image(req);
+		uint64_t dir = toId(ino);
+		uint64_t numEntries = fs.getNumEntries(dir);
+		uint64_t first = fs.getArrayIndex(dir);
+
+		std::vector<char> buffer(size);
+		size_t used = 0;
+		for (uint64_t index = (uint64_t) off; index < numEntries; ++index)
+		{
+			struct stat st;
+			memset(&st, 0, sizeof(st));
+			st.st_ino = toIno(first + index);
+			st.st_mode = (mode_t) fs.getMode(first + index);
+			size_t len = fuse_add_direntry(req, buffer.data() + used, size - used, fs.getName(first + index), &st, (off_t)(index + 1));
+			if (len > size - used)
+				break;
+			used += len;
+		}
+		fuse_reply_buf(req, buffer.data(), used);
+	}
 
-	uint64_t getFileSize(uint64_t id) const
+	static void statfs(fuse_req_t req, fuse_ino_t)
 	{
-		return inode_file_size.axfs_bytetable_stitch(id);
-	};
+		axfs& fs = image(req);
+		struct statvfs st;
+		memset(&st, 0, sizeof(st));
+		st.f_bsize = PAGE_CACHE_SIZE;
+		st.f_frsize = PAGE_CACHE_SIZE;
+		st.f_blocks = (fsblkcnt_t)((fs.superblock.size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT);
+		st.f_files = (fsfilcnt_t) fs.superblock.files;
+		st.f_namemax = 255;
+		st.f_flag = ST_RDONLY;
+		fuse_reply_statfs(req, &st);
+	}
 
-	uint64_t getMode(uint64_t id)const
+	// mount at the mountpoint in args and serve until unmounted, args are the
+	// usual FUSE command line: mountpoint [-f] [-s] [-d] [-o options]
+	int run(int argc, char* argv[])
 	{
-		auto modeIndex = inode_mode_index.axfs_bytetable_stitch(id);
-		return modes.axfs_bytetable_stitch(modeIndex);
-	};
+		fuse_args args = FUSE_ARGS_INIT(argc, argv);
+		fuse_opt_add_arg(&args, "-oro,default_permissions,subtype=axfs");
+		fuse_cmdline_opts opts;
+		if (fuse_parse_cmdline(&args, &opts) != 0 || !opts.mountpoint)
+		{
+			printf("usage: axfs mount <image> <mountpoint> [-f] [-s] [-d] [-o options]\n");
+			fuse_opt_free_args(&args);
+			return 1;
+		}
+
+		fuse_lowlevel_ops ops;
+		memset(&ops, 0, sizeof(ops));
+		ops.init = &axfs_fuse::init;
+		ops.lookup = &axfs_fuse::lookup;
+		ops.getattr = &axfs_fuse::getattr;
+		ops.readlink = &axfs_fuse::readlink;
+		ops.open = &axfs_fuse::open;
+		ops.read = &axfs_fuse::read;
+		ops.opendir = &axfs_fuse::opendir;
+		ops.readdir = &axfs_fuse::readdir;
+		ops.statfs = &axfs_fuse::statfs;
+
+		int result = 1;
+		fuse_session* session = fuse_session_new(&args, &ops, sizeof(ops), this);
+		if (session)
+		{
+			if (fuse_set_signal_handlers(session) == 0)
+			{
+				if (fuse_session_mount(session, opts.mountpoint) == 0)
+				{
+					fuse_daemonize(opts.foreground);
+					result = opts.singlethread ? fuse_session_loop(session) : fuse_session_loop_mt(session, opts.clone_fd);
+					fuse_session_unmount(session);
+				}
+				fuse_remove_signal_handlers(session);
+			}
+			fuse_session_destroy(session);
+		}
+		free(opts.mountpoint);
+		fuse_opt_free_args(&args);
+		return result ? 1 : 0;
+	}
+};
+#endif
+
+// The backend named by the AXFS_CODEC environment variable, to be used instead
+// of the default one for its compression type.  codec is left nullptr if it is
+// not set, false if no backend of that name was built in.
+static bool axfs_env_codec(const axfs_codec*& codec)
+{
+	codec = nullptr;
+	const char* name = getenv("AXFS_CODEC");
+	if (!name || !*name)
+		return true;
+	codec = axfs_find_codec(name);
+	if (codec)
+		return true;
+	printf("AXFS_CODEC: no %s backend built in, there is", name);
+	for (auto& c : axfs_codecs)
+		printf(" %s", c.name);
+	printf("\n");
+	return false;
+}
+
+// The AXFS_TABLE_BYTES environment variable, memory the commands may spend on
+// expanding lookup tables; 0 when not set, false if it is not a number.
+static bool axfs_env_table_bytes(uint64_t& bytes)
+{
+	bytes = 0;
+	const char* value = getenv("AXFS_TABLE_BYTES");
+	if (!value || !*value)
+		return true;
+	char* end;
+	bytes = strtoull(value, &end, 0);
+	if (!*end)
+		return true;
+	printf("AXFS_TABLE_BYTES: %s is not a number of bytes\n", value);
+	return false;
+}
+
+// Inflate every cblock of the image with each codec built in for its compression
+// type and report the uncompressed throughput.  Output is checked against the
+// default codec of the type.  False if a codec failed to decode a cblock.
+bool benchCodecs(axfs& fs, int rounds)
+{
+	uint64_t cblocks = fs.getCblockCount();
+	uint64_t cblockSize = fs.superblock.cblock_size;
+	std::vector<u8> reference((size_t)(cblocks * cblockSize));
+	std::vector<int64_t> lengths((size_t) cblocks);
+	std::vector<u8> out((size_t) cblockSize);
+	const void* compressedData = fs.compressed.getData();
+	bool ok = true;
 
-	uint64_t getNumEntries(uint64_t id)const
+	for (auto& codec : axfs_codecs)
 	{
-		return inode_num_entries.axfs_bytetable_stitch(id);
-	};
+		const axfs_codec* first = axfs_find_codec(codec.type);
+		uint64_t blocks = 0;
+		for (uint64_t i = 0; i < cblocks; ++i)
+			blocks += fs.getCblockType(i) == codec.type;
+		if (blocks == 0)
+			continue;
+
+		uint64_t bytes = 0;
+		uint64_t failed = 0;
+		bool same = true;
+		auto begin = std::chrono::steady_clock::now();
+		for (int round = 0; round < rounds; ++round)
+		{
+			for (uint64_t i = 0; i < cblocks; ++i)
+			{
+				if (fs.getCblockType(i) != codec.type)
+					continue;
+				uint64_t srcOffset = fs.cblock_offset.axfs_bytetable_stitch(i);
+				uint64_t srcSize = fs.cblock_offset.axfs_bytetable_stitch(i + 1) - srcOffset;
+				auto len = codec.decode(out.data(), cblockSize, axfs::offsetAddress((void*)compressedData, srcOffset), srcSize);
+				u8* expected = &reference[(size_t)(i * cblockSize)];
+				if (len < 0)
+				{
+					// a block the default codec cannot decode has nothing to compare against
+					++failed;
+					if (&codec == first)
+						lengths[(size_t) i] = -1;
+					continue;
+				}
+				bytes += len;
+
+				if (&codec == first)
+				{
+					memcpy(expected, out.data(), (size_t) len);
+					lengths[(size_t) i] = len;
+				}
+				else if (len != lengths[(size_t) i] || memcmp(expected, out.data(), (size_t) len) != 0)
+				{
+					same = false;
+				}
+			}
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		printf("%-12s %" PRIu64 " cblocks x %d: %8.1f MB/s%s", codec.name, blocks, rounds,
+			seconds > 0 ? bytes / seconds / 1e6 : 0.0, same ? "" : "  OUTPUT DIFFERS");
+		if (failed)
+			printf("  %" PRIu64 " DECODES FAILED", failed);
+		printf("\n");
+		ok = ok && same && !failed;
+	}
+	return ok;
+}
+
+#define AXFS_BENCH_STITCH_ENTRIES (1 << 20)	/* entries of each synthetic bytetable */
+#define AXFS_BENCH_RANDOM_READS 4096	/* random page reads per round */
 
-	uint64_t getArrayIndex(uint64_t id)const
+// Timings of the reader's hot paths on one image: open in each load mode, the
+// metadata walk ls does, bytetable stitches per depth, single page reads by
+// node type and cblock inflates.  Every sample is one operation, or one round
+// where an operation is too short to time.  Results go to stdout and, one JSON
+// object per line, are appended to a results file to compare across commits.
+struct axfs_bench
+{
+	struct samples
 	{
-		return inode_array_index.axfs_bytetable_stitch(id);
+		std::string name;
+		std::vector<double> ns;
+		uint64_t bytes = 0;	/* processed by all samples together, for MB/s */
+		uint64_t ops = 0;	/* operations in all samples together, when samples are rounds */
+		uint64_t failures = 0;	/* operations that failed, neither timed nor counted */
 	};
 
-	uint64_t getNodeType(uint64_t id) const
+	const char* filename;
+	int rounds;
+	const axfs_codec* codec;	/* in place of the image type's default backend, or nullptr */
+	uint64_t tableBytes;	/* for expanding lookup tables at load */
+	std::deque<samples> results;	/* samples stay put while more are added */
+	std::mt19937_64 random;	/* default seed, every run makes the same choices */
+
+	axfs_bench(const char* filename, int rounds, const axfs_codec* codec, uint64_t tableBytes)
+		: filename(filename), rounds(std::max(rounds, 1)), codec(codec), tableBytes(tableBytes)
+	{ }
+
+	typedef std::chrono::steady_clock clock;
+
+	static double since(clock::time_point begin)
 	{
-		return node_type.axfs_bytetable_stitch(id);
+		return std::chrono::duration<double, std::nano>(clock::now() - begin).count();
 	}
 
-	uint64_t getByteAlignedOffset(uint64_t id) const
+	samples& add(const std::string& name)
 	{
-		return banode_offset.axfs_bytetable_stitch(id);
+		results.push_back(samples());
+		results.back().name = name;
+		return results.back();
 	}
 
+	void benchOpen()
+	{
+		static const struct { axfs_load_mode mode; const char* name; } modes[] = {
+			{ AXFS_LOAD_COPY, "open.copy" },
+			{ AXFS_LOAD_MMAP, "open.mmap" },
+			{ AXFS_LOAD_LAZY, "open.lazy" },
+		};
+		for (auto& m : modes)
+		{
+			auto& s = add(m.name);
+			for (int round = 0; round < rounds; ++round)
+			{
+				auto begin = clock::now();
+				{
+					axfs fs;
+					fs.source.verbose = false;
+					fs.source.codec = codec;
+					fs.tableBytes = tableBytes;
+					if (fs.load(filename, m.mode))
+					{
+						++s.failures;
+						continue;
+					}
+				}
+				s.ns.push_back(since(begin));
+			}
+		}
+	}
 
-	static void* offsetAddress(void* addr, uint64_t offset)
+	// what ls visits, without the printing
+	static uint64_t walk(const axfs& fs, uint64_t id)
 	{
-		return ((void*)((uintptr_t)(addr)+(offset)));
+		uint64_t numFiles = fs.getNumEntries(id);
+		uint64_t first = fs.getArrayIndex(id);
+		std::vector<uint64_t> nameOffsets((size_t) numFiles);
+		std::vector<uint64_t> modeIndices((size_t) numFiles);
+		std::vector<uint64_t> sizes((size_t) numFiles);
+		fs.inode_name_offset.axfs_bytetable_stitch_range(first, numFiles, nameOffsets.data());
+		fs.inode_mode_index.axfs_bytetable_stitch_range(first, numFiles, modeIndices.data());
+		fs.inode_file_size.axfs_bytetable_stitch_range(first, numFiles, sizes.data());
+
+		uint64_t visited = numFiles;
+		for (uint64_t i = 0; i < numFiles; ++i)
+		{
+			visited += strlen((const char*)fs.strings.getData() + nameOffsets[i]) + sizes[i];
+			if (S_ISDIR(fs.modes.axfs_bytetable_stitch(modeIndices[i])))
+				visited += walk(fs, first + i);
+		}
+		return visited;
 	}
 
-	void* readFile(uint64_t id, void* data, uint64_t start, uint64_t length) const
+	void benchWalk(const axfs& fs)
 	{
-		uint64_t fileSize = getFileSize(id);
+		auto& s = add("walk");
+		volatile uint64_t sink = 0;
+		for (int round = 0; round < rounds; ++round)
+		{
+			auto begin = clock::now();
+			sink = sink + walk(fs, 0);
+			s.ns.push_back(since(begin));
+			s.ops += fs.superblock.files;
+		}
+	}
 
-		length = std::min(fileSize - start, length);
+	// a synthetic table per depth, so every depth is measured whatever the image holds
+	void benchStitch()
+	{
+		std::vector<uint64_t> indices(AXFS_BENCH_STITCH_ENTRIES);
+		for (auto& index : indices)
+			index = random() % AXFS_BENCH_STITCH_ENTRIES;
+		std::vector<uint64_t> out(AXFS_STITCH_BATCH);
 
-		uint64_t arrayIndex = getArrayIndex(id);
-		uint64_t offset = 0;
-		void* out = data;
-		while (length > 0)
+		for (u8 depth = 1; depth <= 8; ++depth)
 		{
-			uint64_t nodeIndex = getNodeIndex(arrayIndex);
+			axfs_region table;
+			table.size.set((uint64_t) AXFS_BENCH_STITCH_ENTRIES * depth);
+			table.max_index.set(AXFS_BENCH_STITCH_ENTRIES);
+			table.table_byte_depth = depth;
+			table.data = malloc((size_t) table.size);
+			for (uint64_t i = 0; i < table.size; ++i)
+				((u8*) table.data)[i] = (u8) random();
+			table.prepareStitch();
+			table.resolve();
 
-			switch (getNodeType(arrayIndex))
-			{
-			case 2: // Byte_aligned
+			auto& one = add("stitch.random.depth" + std::to_string(depth));
+			auto& range = add("stitch.range.depth" + std::to_string(depth));
+			volatile uint64_t sink = 0;
+			for (int round = 0; round < rounds; ++round)
 			{
-				uint64_t srcOffset = getByteAlignedOffset(nodeIndex);
-				uint64_t blockSize = std::min(1llu << PAGE_SHIFT, length);
-				memcpy(offsetAddress(out, offset), offsetAddress(byte_aligned.data, srcOffset), (size_t) blockSize);
-				length -= blockSize;
-				offset += blockSize;
-				break;
-			}
-			case 0: // XIP
-			{
-				memcpy(offsetAddress(out, offset), offsetAddress(xip.data, nodeIndex << PAGE_SHIFT), 1 << PAGE_SHIFT);
-				offset += 1 << PAGE_SHIFT;
-				length -= 1 << PAGE_SHIFT;
-				break;
-			}
-			case 1: // Compressed
-			{
-				uint64_t cnodeOffset = cnode_offset.axfs_bytetable_stitch(nodeIndex);
-				uint64_t cnodeIndex = cnode_index.axfs_bytetable_stitch(nodeIndex);
-				uint64_t srcOffset = cblock_offset.axfs_bytetable_stitch(cnodeIndex);
-				uint64_t len = cblock_offset.axfs_bytetable_stitch(cnodeIndex + 1) - srcOffset;
-				if (cachedBlock != cnodeIndex)
+				auto begin = clock::now();
+				uint64_t sum = 0;
+				for (auto index : indices)
+					sum += table.axfs_bytetable_stitch(index);
+				one.ns.push_back(since(begin));
+				one.ops += indices.size();
+
+				begin = clock::now();
+				for (uint64_t first = 0; first < AXFS_BENCH_STITCH_ENTRIES; first += AXFS_STITCH_BATCH)
 				{
-					stbi_zlib_decode_buffer((char*)cblock_buffer, (int) superblock.cblock_size, (const char*)offsetAddress(compressed.data, srcOffset), (int) len);
-					cachedBlock = cnodeIndex;
+					table.axfs_bytetable_stitch_range(first, AXFS_STITCH_BATCH, out.data());
+					sum += out[0];
 				}
-				len = std::min(superblock.cblock_size - cnodeOffset, length);
-				memcpy(offsetAddress(out, offset), offsetAddress(cblock_buffer, cnodeOffset), (size_t) len);
-				length -= len;
-				offset += len;
-				break;
-			}
-			default:
-				assert(false);
-				break;
+				range.ns.push_back(since(begin));
+				range.ops += AXFS_BENCH_STITCH_ENTRIES;
+				sink = sink + sum;
 			}
+		}
+	}
 
-			++arrayIndex;
+	// single page reads, filed under the node type of the page
+	void benchRead(const axfs& fs)
+	{
+		static const char* const typeNames[] = { "xip", "compressed", "byte_aligned" };
+		std::vector<std::pair<uint64_t, uint64_t>> pages;	/* inode and page */
+		for (uint64_t id = 0; id < fs.superblock.files; ++id)
+		{
+			if (!S_ISREG(fs.getMode(id)))
+				continue;
+			uint64_t count = (fs.getFileSize(id) + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+			for (uint64_t page = 0; page < count; ++page)
+				pages.push_back(std::make_pair(id, page));
 		}
+		if (pages.empty())
+			return;
+
+		std::vector<u8> buffer(PAGE_CACHE_SIZE);
+		for (int pattern = 0; pattern < 2; ++pattern)
+		{
+			samples* byType[3];
+			for (int type = 0; type < 3; ++type)
+				byType[type] = &add(std::string(pattern ? "read.random." : "read.sequential.") + typeNames[type]);
 
-		return data;
+			for (int round = 0; round < rounds; ++round)
+			{
+				size_t count = pattern ? AXFS_BENCH_RANDOM_READS : pages.size();
+				for (size_t i = 0; i < count; ++i)
+				{
+					auto& page = pattern ? pages[(size_t)(random() % pages.size())] : pages[i];
+					uint64_t type = fs.getNodeType(fs.getArrayIndex(page.first) + page.second);
+					auto begin = clock::now();
+					auto read = fs.readFile(page.first, buffer.data(), page.second << PAGE_SHIFT, PAGE_CACHE_SIZE);
+					auto& s = *byType[type];
+					if (!read)
+					{
+						++s.failures;
+						continue;
+					}
+					s.ns.push_back(since(begin));
+					s.bytes += std::min(fs.getFileSize(page.first) - (page.second << PAGE_SHIFT), (uint64_t) PAGE_CACHE_SIZE);
+				}
+			}
+		}
 	}
 
-	void printInfo(uint64_t id) const
+	// every path of the image resolved by directory search, then through the path index
+	void benchLookup(axfs& fs)
 	{
-		uint64_t arrayIndex = getArrayIndex(id);
-		uint64_t last = (getFileSize(id) + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
-		for (auto i = 0; i < last; ++i)
+		std::vector<std::string> paths;
+		std::vector<std::pair<uint64_t, std::string>> pending(1, std::make_pair((uint64_t) 0, std::string()));
+		while (!pending.empty())
 		{
-			switch (getNodeType(arrayIndex + i))
+			auto dir = pending.back();
+			pending.pop_back();
+			uint64_t first = fs.getArrayIndex(dir.first);
+			for (uint64_t id = first; id < first + fs.getNumEntries(dir.first); ++id)
 			{
-			case 0: // XIP
-				printf("X");
-				break;
-			case 1: // Compressed
-				printf("c");
-				break;
-			case 2: // bytes
-				printf("b");
-				break;
-			default:
-				assert(false);
-				break;
+				std::string path = dir.second + "/" + fs.getName(id);
+				if (S_ISDIR(fs.getMode(id)))
+					pending.push_back(std::make_pair(id, path));
+				paths.push_back(path);
 			}
 		}
+		if (paths.empty())
+			return;
 
-		printf("\n");
+		auto& search = add("lookup.search");
+		auto& build = add("lookup.index.build");
+		auto& indexed = add("lookup.index");
+		volatile uint64_t sink = 0;
+		for (int round = 0; round < rounds; ++round)
+		{
+			fs.pathIndex.reset();
+			auto begin = clock::now();
+			for (auto& path : paths)
+				sink = sink + fs.lookup(path.c_str());
+			search.ns.push_back(since(begin));
+			search.ops += paths.size();
+
+			begin = clock::now();
+			fs.indexPaths(std::thread::hardware_concurrency());
+			build.ns.push_back(since(begin));
+			build.ops += fs.superblock.files;
+
+			begin = clock::now();
+			for (auto& path : paths)
+				sink = sink + fs.lookup(path.c_str());
+			indexed.ns.push_back(since(begin));
+			indexed.ops += paths.size();
+		}
+		fs.pathIndex.reset();
 	}
 
-	void ls(uint64_t id, bool recursive = true, int level = 0) const
+	void benchInflate(const axfs& fs)
 	{
-		uint64_t numFiles = getNumEntries(id);
-		uint64_t first = getArrayIndex(id);
-
-		for (uint64_t i = 0; i < numFiles; ++i)
+		auto& s = add("inflate");
+		std::vector<u8> out(fs.superblock.cblock_size);
+		for (int round = 0; round < rounds; ++round)
 		{
-			printf("%3lld:", first + i);
-			for (int j = 0; j < level; ++j)
-				printf("\t");
-			const char* name = getName(first + i);
-			auto mode = getMode(first + i);
-			if (S_ISDIR(mode))
+			for (uint64_t i = 0; i < fs.getCblockCount(); ++i)
 			{
-				printf("%s/\n", name);
-				if (recursive)
+				auto begin = clock::now();
+				auto len = fs.tryInflateCblock(i, out.data());
+				if (len < 0)
 				{
-					ls(first + i, recursive, level + 1);
+					++s.failures;
+					continue;
 				}
+				s.ns.push_back(since(begin));
+				s.bytes += len;
 			}
-			else if (S_ISLNK(mode))
-			{
-				uint64_t size = getFileSize(first + i);
-				char linkName[1024];
-				readFile(first + i, linkName, 0, sizeof(linkName));
-				linkName[size] = 0;
-				printf("%s -> %s\n", name, linkName);
-			}
-			else if (S_ISREG(mode))
-			{
-				uint64_t size = getFileSize(first + i);
-				printf("%s\t%lld ", name, size);
-				printInfo(first + i);
-			}
-			else
+		}
+	}
+
+	static double percentile(const std::vector<double>& sorted, double p)
+	{
+		return sorted[(size_t)(p * (sorted.size() - 1) + 0.5)];
+	}
+
+	// print every result and append them to resultsFile, if any, tagged with label
+	void report(const char* resultsFile, const char* label)
+	{
+		FILE* out = nullptr;
+		if (resultsFile)
+		{
+			fopen_s(&out, resultsFile, "a");
+			if (!out)
+				printf("%s: cannot append results\n", resultsFile);
+		}
+
+		std::string image;
+		for (const char* c = filename; *c; ++c)
+		{
+			if (*c == '"' || *c == '\\')
+				image += '\\';
+			image += *c;
+		}
+
+		printf("%-26s %8s %12s %12s %12s %12s %12s %10s %10s %8s\n", "", "samples", "mean ns", "p50 ns", "p90 ns", "p99 ns", "max ns", "Mops/s", "MB/s", "failed");
+		for (auto& s : results)
+		{
+			if (s.ns.empty() && !s.failures)
+				continue;
+			// a bench where every operation failed still reports its failures
+			std::vector<double> sorted(s.ns);
+			std::sort(sorted.begin(), sorted.end());
+			if (sorted.empty())
+				sorted.push_back(0);
+			double total = 0;
+			for (auto ns : sorted)
+				total += ns;
+			double mean = total / sorted.size();
+			double mops = s.ops && total > 0 ? s.ops / total * 1e3 : 0;
+			double mbs = s.bytes && total > 0 ? s.bytes / total * 1e3 : 0;
+			printf("%-26s %8" PRIu64 " %12.0f %12.0f %12.0f %12.0f %12.0f %10.1f %10.1f %8" PRIu64 "\n", s.name.c_str(), (uint64_t) s.ns.size(),
+				mean, percentile(sorted, 0.5), percentile(sorted, 0.9), percentile(sorted, 0.99), sorted.back(), mops, mbs, s.failures);
+			if (out)
 			{
-				printf("%s?\n", name);
+				fprintf(out, "{\"label\":\"%s\",\"image\":\"%s\",\"bench\":\"%s\",\"samples\":%" PRIu64 ",\"mean_ns\":%.0f,\"p50_ns\":%.0f,\"p90_ns\":%.0f,\"p99_ns\":%.0f,\"max_ns\":%.0f,\"mops\":%.3f,\"mb_per_s\":%.3f,\"failures\":%" PRIu64 "}\n",
+					label, image.c_str(), s.name.c_str(), (uint64_t) s.ns.size(), mean, percentile(sorted, 0.5),
+					percentile(sorted, 0.9), percentile(sorted, 0.99), sorted.back(), mops, mbs, s.failures);
 			}
 		}
-	};
+		if (out)
+			fclose(out);
+	}
 
-	uint64_t getNodeIndex(uint64_t id) const
+	// false if the image did not load or any operation failed
+	bool run(const char* resultsFile, const char* label)
 	{
-		return node_index.axfs_bytetable_stitch(id);
-	};
-
+		benchOpen();
+		axfs fs;
+		fs.source.verbose = false;
+		fs.source.codec = codec;
+		fs.tableBytes = tableBytes;
+		if (int result = fs.load(filename))
+		{
+			printf("%s: %s\n", filename, axfs_error_text(result));
+			return false;
+		}
+		benchWalk(fs);
+		benchStitch();
+		benchRead(fs);
+		benchInflate(fs);
+		benchLookup(fs);
+		report(resultsFile, label);
+		for (auto& s : results)
+		{
+			if (s.failures)
+				return false;
+		}
+		return true;
+	}
 };
 
-int main()
+// options of mkfs from argv[first] on, and those of synth if synth is given
+static bool parseBuildOptions(int argc, char* argv[], int first, axfs_build_options& options, axfs_synthetic_options* synth)
+{
+	options.threads = std::thread::hardware_concurrency();
+	// a made up tree rarely repeats a page, the hash of every page would only cost memory
+	options.dedupe = !synth;
+	if (auto epoch = getenv("SOURCE_DATE_EPOCH"))
+		options.timestamp = strtoull(epoch, nullptr, 10);
+	for (int i = first; i < argc; ++i)
+	{
+		const char* value = i + 1 < argc ? argv[i + 1] : "";
+		if (strcmp(argv[i], "-b") == 0)
+			options.cblockSize = (uint32_t) atoi(value), ++i;
+		else if (strcmp(argv[i], "-c") == 0)
+		{
+			u8 type = 0;
+			while (type < AXFS_COMPRESSION_TYPES && strcmp(axfs_compression_name(type), value) != 0)
+				++type;
+			options.compressionType = type;
+			++i;
+		}
+		else if (strcmp(argv[i], "-l") == 0)
+			options.level = atoi(value), ++i;
+		else if (strcmp(argv[i], "-j") == 0)
+			options.threads = (unsigned) atoi(value), ++i;
+		else if (strcmp(argv[i], "-t") == 0)
+			options.tailLimit = strtoull(value, nullptr, 10), ++i;
+		else if (strcmp(argv[i], "-x") == 0)
+			options.xipProfile = value, ++i;
+		else if (strcmp(argv[i], "-X") == 0)
+			options.xipBudget = strtoull(value, nullptr, 10), ++i;
+		else if (strcmp(argv[i], "-d") == 0)
+			options.minTableDepth = (u8) std::min(atoi(value), 8), ++i;
+		else if (strcmp(argv[i], "-M") == 0)
+			options.memoryLimit = strtoull(value, nullptr, 10), ++i;
+		else if (strcmp(argv[i], "-m") == 0)
+			options.compressMetadata = true;
+		else if (strcmp(argv[i], "-p") == 0)
+			options.perCblockCodec = true;
+		else if (strcmp(argv[i], "-D") == 0)
+			options.dedupe = false;
+		else if (synth && strcmp(argv[i], "-u") == 0)
+			options.dedupe = true;
+		else if (strcmp(argv[i], "-P") == 0)
+			options.localityPacking = false;
+		else if (synth && strcmp(argv[i], "-n") == 0)
+			synth->files = strtoull(value, nullptr, 10), ++i;
+		else if (synth && strcmp(argv[i], "-F") == 0)
+			synth->fanout = strtoull(value, nullptr, 10), ++i;
+		else if (synth && strcmp(argv[i], "-s") == 0)
+			synth->minSize = strtoull(value, nullptr, 10), ++i;
+		else if (synth && strcmp(argv[i], "-S") == 0)
+			synth->maxSize = strtoull(value, nullptr, 10), ++i;
+		else if (synth && strcmp(argv[i], "-A") == 0)
+			synth->xipPercent = (unsigned) atoi(value), ++i;
+		else if (synth && strcmp(argv[i], "-B") == 0)
+			synth->byteAlignedPercent = (unsigned) atoi(value), ++i;
+		else if (synth && strcmp(argv[i], "-E") == 0)
+			synth->entropyPercent = (unsigned) std::min(atoi(value), 100), ++i;
+		else if (synth && strcmp(argv[i], "-R") == 0)
+			synth->seed = strtoull(value, nullptr, 10), ++i;
+		else
+		{
+			printf("unknown option %s\n", argv[i]);
+			return false;
+		}
+	}
+	if (options.cblockSize < PAGE_CACHE_SIZE || options.cblockSize % PAGE_CACHE_SIZE)
+	{
+		printf("cblock size must be a multiple of %d\n", PAGE_CACHE_SIZE);
+		return false;
+	}
+	if (synth && synth->xipPercent + synth->byteAlignedPercent > 100)
+	{
+		printf("xip and byte aligned pages add up to more than 100%%\n");
+		return false;
+	}
+	return true;
+}
+
+// load an image for one of the commands, saying why if it cannot be
+static bool loadImage(axfs& fs, const char* filename)
 {
+	if (!axfs_env_codec(fs.source.codec) || !axfs_env_table_bytes(fs.tableBytes))
+		return false;
+	int result = fs.load(filename);
+	if (result != AXFS_OK)
+		printf("%s: %s\n", filename, axfs_error_text(result));
+	return result == AXFS_OK;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc >= 4 && strcmp(argv[1], "extract") == 0)
+	{
+		axfs fs;
+		if (!loadImage(fs, argv[2]))
+			return 1;
+		// the extractor trusts the metadata, paths included
+		if (int result = fs.verify())
+		{
+			printf("%s: %s\n", argv[2], axfs_error_text(result));
+			return 1;
+		}
+		unsigned threads = argc >= 5 ? (unsigned) atoi(argv[4]) : std::thread::hardware_concurrency();
+		return axfs_extractor(fs).extract(argv[3], threads) ? 0 : 1;
+	}
+
+	if (argc >= 3 && strcmp(argv[1], "bench") == 0)
+	{
+		const axfs_codec* codec;
+		uint64_t tableBytes;
+		if (!axfs_env_codec(codec) || !axfs_env_table_bytes(tableBytes))
+			return 1;
+		axfs_bench bench(argv[2], argc >= 4 ? atoi(argv[3]) : 5, codec, tableBytes);
+		return bench.run(argc >= 5 ? argv[4] : nullptr, argc >= 6 ? argv[5] : "") ? 0 : 1;
+	}
+
+	if (argc >= 3 && strcmp(argv[1], "codecs") == 0)
+	{
+		axfs fs;
+		if (!loadImage(fs, argv[2]))
+			return 1;
+		return benchCodecs(fs, argc >= 4 ? atoi(argv[3]) : 10) ? 0 : 1;
+	}
+
+#ifdef AXFS_HAVE_FUSE
+	if (argc >= 4 && strcmp(argv[1], "mount") == 0)
+	{
+		axfs fs;
+		if (!loadImage(fs, argv[2]))
+			return 1;
+		// the kernel gets what the metadata says, it has to hold up
+		if (int result = fs.verify())
+		{
+			printf("%s: %s\n", argv[2], axfs_error_text(result));
+			return 1;
+		}
+		// FUSE sees the mountpoint and its own options, not the image
+		std::vector<char*> args(argv + 2, argv + argc);
+		args[0] = argv[0];
+		return axfs_fuse(fs).run((int) args.size(), args.data());
+	}
+#endif
+
+	if (argc >= 4 && strcmp(argv[1], "mkfs") == 0)
+	{
+		axfs_build_options options;
+		if (!parseBuildOptions(argc, argv, 4, options, nullptr))
+			return 1;
+		axfs_builder builder(options);
+		return builder.build(argv[2], argv[3]) ? 0 : 1;
+	}
+
+	if (argc >= 3 && strcmp(argv[1], "synth") == 0)
+	{
+		axfs_build_options options;
+		axfs_synthetic_options synth;
+		if (!parseBuildOptions(argc, argv, 3, options, &synth))
+			return 1;
+		axfs_builder builder(options);
+		return builder.generate(synth, argv[2]) ? 0 : 1;
+	}
+
 	axfs fs;
-	fs.load("initrd.img");
+	if (!loadImage(fs, "initrd.img"))
+	{
+		printf("usage: axfs extract|codecs|bench|mkfs|synth|mount ..., see Readme.md\n");
+		return 1;
+	}
 
 	fs.ls(0);
 
@@ -405,6 +2366,7 @@ int main()
 	void * data = malloc((size_t) size);
 	fs.readFile(19, data, 0, size);
 	free(data);
+	fs.cache.printStats();
 	
     return 0;
 }
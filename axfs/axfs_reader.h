@@ -0,0 +1,2034 @@
+// axfs_reader.h : the image reader, shared by the command line tool and libaxfs.
+// It defines everything it declares, so include it from one source file of a
+// program only.
+//
+// LICENSE: GPL v2.  This project is a derivative work of the linux kernel.
+
+#pragma once
+
+#include "libaxfs.h"
+
+#define STB_IMAGE_STATIC
+#define STB_IMAGE_IMPLEMENTATION
+#ifdef __GNUC__
+// third party, built as is
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmisleading-indentation"
+#pragma GCC diagnostic ignored "-Wshift-negative-value"
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wimplicit-fallthrough"
+#endif
+#include "stb_image.h"
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+
+#ifdef _MSC_VER
+inline uint16_t byteswap(uint16_t v)
+{
+	return _byteswap_ushort(v);
+}
+
+inline uint32_t byteswap(uint32_t v)
+{
+	return _byteswap_ulong(v);
+}
+
+inline uint64_t byteswap(uint64_t v)
+{
+	return _byteswap_uint64(v);
+}
+#else
+inline uint16_t byteswap(uint16_t v)
+{
+	return __builtin_bswap16(v);
+}
+
+inline uint32_t byteswap(uint32_t v)
+{
+	return __builtin_bswap32(v);
+}
+
+inline uint64_t byteswap(uint64_t v)
+{
+	return __builtin_bswap64(v);
+}
+#endif
+
+// keeps rarely taken paths out of the inlined fast ones
+#ifdef _MSC_VER
+#define AXFS_NOINLINE __declspec(noinline)
+#else
+#define AXFS_NOINLINE __attribute__((noinline))
+#endif
+
+#ifndef _WIN32
+// the CRT's fopen_s, for the few places that open files with stdio
+inline int fopen_s(FILE** file, const char* filename, const char* mode)
+{
+	*file = fopen(filename, mode);
+	return *file ? 0 : errno;
+}
+#endif
+
+// wrapper for reading and writing big-endian values
+template<typename T>
+struct BigEndianInt
+{
+	T value;
+
+	operator T() const
+	{
+		return byteswap(value);
+	}
+
+	void set(T v)
+	{
+		value = byteswap(v);
+	}
+};
+
+typedef BigEndianInt<uint32_t> be32;
+typedef BigEndianInt<uint64_t> be64;
+typedef uint8_t u8;
+typedef uint64_t u64;
+
+#ifndef S_ISDIR
+#define	S_ISDIR(m)	((m & 0170000) == 0040000)	/* directory */
+#define	S_ISCHR(m)	((m & 0170000) == 0020000)	/* char special */
+#define	S_ISBLK(m)	((m & 0170000) == 0060000)	/* block special */
+#define	S_ISREG(m)	((m & 0170000) == 0100000)	/* regular file */
+#define	S_ISFIFO(m)	((m & 0170000) == 0010000)	/* fifo */
+#endif
+#ifndef S_ISLNK
+#define	S_ISLNK(m)	((m & 0170000) == 0120000)	/* symbolic link */
+#define	S_ISSOCK(m)	((m & 0170000) == 0140000)	/* socket */
+#endif
+
+#if defined(__AVX2__)
+#define AXFS_SIMD_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define AXFS_SIMD_SSE2
+#endif
+
+#define AXFS_NO_INODE ((uint64_t)-1)
+
+#define AXFS_STITCH_BATCH 64	/* pages whose node entries readFile stitches at once */
+
+/* values of axfs_super_onmedia::compression_type, the codec of every
+   compressed region and cblock in the image */
+#define AXFS_COMPRESSION_ZLIB 0
+#define AXFS_COMPRESSION_LZ4 1	/* LZ4 block format, no frame */
+#define AXFS_COMPRESSION_ZSTD 2	/* single zstd frame */
+#define AXFS_COMPRESSION_XZ 3	/* single xz stream */
+#define AXFS_COMPRESSION_STORED 4	/* not compressed, only valid as a cblock tag */
+#define AXFS_COMPRESSION_TYPES 5
+/* the cblock_codec region tags every cblock with one of the types above;
+   compressed metadata regions of such an image are zlib */
+#define AXFS_COMPRESSION_PER_CBLOCK 0xff
+
+#define PAGE_SHIFT 12
+#define PAGE_CACHE_SHIFT 12
+#define PAGE_CACHE_SIZE (1<<PAGE_CACHE_SHIFT)
+
+/* on media format for the super block */
+struct axfs_super_onmedia
+{
+	be32 magic;		/* 0x48A0E4CD - random number */
+	u8 signature[16];	/* "Advanced XIP FS" */
+	u8 digest[40];		/* sha1 digest for checking data integrity */
+	be32 cblock_size;	/* maximum size of the block being compressed */
+	be64 files;		/* number of inodes/files in fs */
+	be64 size;		/* total image size */
+	be64 blocks;		/* number of nodes in fs */
+	be64 mmap_size;	/* size of the memory mapped part of image */
+	be64 strings;		/* offset to strings region descriptor */
+	be64 xip;		/* offset to xip region descriptor */
+	be64 byte_aligned;	/* offset to the byte aligned region desc */
+	be64 compressed;	/* offset to the compressed region desc */
+	be64 node_type;	/* offset to node type region desc */
+	be64 node_index;	/* offset to node index region desc */
+	be64 cnode_offset;	/* offset to cnode offset region desc */
+	be64 cnode_index;	/* offset to cnode index region desc */
+	be64 banode_offset;	/* offset to banode offset region desc */
+	be64 cblock_offset;	/* offset to cblock offset region desc */
+	be64 inode_file_size;	/* offset to inode file size desc */
+	be64 inode_name_offset;	/* offset to inode num_entries region desc */
+	be64 inode_num_entries;	/* offset to inode num_entries region desc */
+	be64 inode_mode_index;	/* offset to inode mode index region desc */
+	be64 inode_array_index;	/* offset to inode node index region desc */
+	be64 modes;		/* offset to mode mode region desc */
+	be64 uids;		/* offset to mode uid index region desc */
+	be64 gids;		/* offset to mode gid index region desc */
+	u8 version_major;
+	u8 version_minor;
+	u8 version_sub;
+	u8 compression_type;	/* Identifies type of compression used on FS */
+	be64 timestamp;	/* UNIX time_t of filesystem build time */
+	u8 page_shift;
+	u8 reserved[3];
+	be32 cblock_codec;	/* offset to cblock codec region desc, only if
+				   compression_type is AXFS_COMPRESSION_PER_CBLOCK */
+};
+
+struct axfs_region_desc_onmedia
+{
+	be64 fsoffset;
+	be64 size;
+	be64 compressed_size;
+	be64 max_index;
+	u8 table_byte_depth;
+	u8 incore;
+};
+
+enum axfs_load_mode
+{
+	AXFS_LOAD_COPY = 0,	/* fread every region into its own heap buffer */
+	AXFS_LOAD_MMAP,		/* map the image once, regions point into the mapping */
+	AXFS_LOAD_LAZY,		/* parse descriptors only, fread a region on first touch */
+};
+
+// read-only mapping of a whole image file
+struct axfs_mapping
+{
+	void* base = nullptr;
+	uint64_t size = 0;
+	bool borrowed = false;	/* base belongs to the caller, see borrow */
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE view = nullptr;
+#endif
+
+	~axfs_mapping()
+	{
+		close();
+	}
+
+	bool open(const char* filename)
+	{
+#ifdef _WIN32
+		file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(file, &fileSize);
+		size = (uint64_t)fileSize.QuadPart;
+		view = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!view)
+			return false;
+		base = MapViewOfFile(view, FILE_MAP_READ, 0, 0, 0);
+#else
+		int fd = ::open(filename, O_RDONLY);
+		if (fd < 0)
+			return false;
+		size = (uint64_t)lseek(fd, 0, SEEK_END);
+		base = mmap(nullptr, (size_t) size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd); // the mapping keeps its own reference to the file
+		if (base == MAP_FAILED)
+			base = nullptr;
+#endif
+		return base != nullptr;
+	}
+
+	// map an open file, the descriptor stays the caller's
+	bool openFd(int fd)
+	{
+#ifdef _WIN32
+		HANDLE handle = (HANDLE) _get_osfhandle(fd);
+		if (handle == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(handle, &fileSize);
+		size = (uint64_t)fileSize.QuadPart;
+		view = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!view)
+			return false;
+		base = MapViewOfFile(view, FILE_MAP_READ, 0, 0, 0);
+#else
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+			return false;
+		size = (uint64_t) st.st_size;
+		base = mmap(nullptr, (size_t) size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (base == MAP_FAILED)
+			base = nullptr;
+#endif
+		return base != nullptr;
+	}
+
+	// an image that is already in memory, nothing to map or unmap
+	void borrow(const void* data, uint64_t length)
+	{
+		base = (void*) data;
+		size = length;
+		borrowed = true;
+	}
+
+	void close()
+	{
+		if (borrowed)
+			base = nullptr;
+		borrowed = false;
+#ifdef _WIN32
+		if (base)
+			UnmapViewOfFile(base);
+		if (view)
+			CloseHandle(view);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		view = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (base)
+			munmap(base, (size_t) size);
+#endif
+		base = nullptr;
+		size = 0;
+	}
+
+	void* address(uint64_t offset) const
+	{
+		assert(offset <= size);
+		return (void*)((uintptr_t)base + offset);
+	}
+};
+
+// Whole buffer inflater.  Compressed regions and cblocks are single streams
+// whose uncompressed size is known up front, so there is no streaming state.
+struct axfs_codec
+{
+	const char* name;
+	u8 type;	/* the AXFS_COMPRESSION_* it decodes */
+
+	// inflate src into dst, returns the number of bytes produced or -1 if the
+	// stream is damaged or does not fit into capacity
+	int64_t (*decode)(void* dst, uint64_t capacity, const void* src, uint64_t srcSize);
+};
+
+static int64_t axfs_stb_decode(void* dst, uint64_t capacity, const void* src, uint64_t srcSize)
+{
+	return stbi_zlib_decode_buffer((char*)dst, (int) capacity, (const char*)src, (int) srcSize);
+}
+
+#ifdef AXFS_HAVE_ZLIB
+static int64_t axfs_zlib_decode(void* dst, uint64_t capacity, const void* src, uint64_t srcSize)
+{
+	uLongf len = (uLongf) capacity;
+	if (uncompress((Bytef*)dst, &len, (const Bytef*)src, (uLong) srcSize) != Z_OK)
+		return -1;
+	return (int64_t) len;
+}
+#endif
+
+#ifdef AXFS_HAVE_LIBDEFLATE
+static int64_t axfs_libdeflate_decode(void* dst, uint64_t capacity, const void* src, uint64_t srcSize)
+{
+	// a decompressor must not be shared between threads, keep one per thread
+	struct holder
+	{
+		libdeflate_decompressor* d = libdeflate_alloc_decompressor();
+		~holder() { libdeflate_free_decompressor(d); }
+	};
+	static thread_local holder decompressor;
+
+	size_t len = 0;
+	if (libdeflate_zlib_decompress(decompressor.d, src, (size_t) srcSize, dst, (size_t) capacity, &len) != LIBDEFLATE_SUCCESS)
+		return -1;
+	return (int64_t) len;
+}
+#endif
+
+static int64_t axfs_stored_decode(void* dst, uint64_t capacity, const void* src, uint64_t srcSize)
+{
+	if (srcSize > capacity)
+		return -1;
+	memcpy(dst, src, (size_t) srcSize);
+	return (int64_t) srcSize;
+}
+
+#ifdef AXFS_HAVE_LZ4
+static int64_t axfs_lz4_decode(void* dst, uint64_t capacity, const void* src, uint64_t srcSize)
+{
+	int len = LZ4_decompress_safe((const char*)src, (char*)dst, (int) srcSize, (int) capacity);
+	return len < 0 ? -1 : len;
+}
+#endif
+
+#ifdef AXFS_HAVE_ZSTD
+static int64_t axfs_zstd_decode(void* dst, uint64_t capacity, const void* src, uint64_t srcSize)
+{
+	size_t len = ZSTD_decompress(dst, (size_t) capacity, src, (size_t) srcSize);
+	return ZSTD_isError(len) ? -1 : (int64_t) len;
+}
+#endif
+
+#ifdef AXFS_HAVE_LZMA
+static int64_t axfs_xz_decode(void* dst, uint64_t capacity, const void* src, uint64_t srcSize)
+{
+	uint64_t memlimit = UINT64_MAX;
+	size_t inPos = 0;
+	size_t outPos = 0;
+	if (lzma_stream_buffer_decode(&memlimit, 0, nullptr, (const uint8_t*)src, &inPos, (size_t) srcSize, (uint8_t*)dst, &outPos, (size_t) capacity) != LZMA_OK)
+		return -1;
+	return (int64_t) outPos;
+}
+#endif
+
+// the backends built in, fastest first within a compression type; the first
+// one for the image's type is the default
+static const axfs_codec axfs_codecs[] = {
+#ifdef AXFS_HAVE_LIBDEFLATE
+	{ "libdeflate", AXFS_COMPRESSION_ZLIB, &axfs_libdeflate_decode },
+#endif
+#ifdef AXFS_HAVE_ZLIB
+	{ "zlib", AXFS_COMPRESSION_ZLIB, &axfs_zlib_decode },
+#endif
+	{ "stb", AXFS_COMPRESSION_ZLIB, &axfs_stb_decode },
+#ifdef AXFS_HAVE_LZ4
+	{ "lz4", AXFS_COMPRESSION_LZ4, &axfs_lz4_decode },
+#endif
+#ifdef AXFS_HAVE_ZSTD
+	{ "zstd", AXFS_COMPRESSION_ZSTD, &axfs_zstd_decode },
+#endif
+#ifdef AXFS_HAVE_LZMA
+	{ "xz", AXFS_COMPRESSION_XZ, &axfs_xz_decode },
+#endif
+	{ "stored", AXFS_COMPRESSION_STORED, &axfs_stored_decode },
+};
+
+static const char* axfs_compression_name(u8 type)
+{
+	static const char* names[] = { "zlib", "lz4", "zstd", "xz", "stored" };
+	if (type == AXFS_COMPRESSION_PER_CBLOCK)
+		return "per cblock";
+	return type < sizeof(names) / sizeof(names[0]) ? names[type] : "unknown";
+}
+
+// codec by name, nullptr if it was not built in
+static const axfs_codec* axfs_find_codec(const char* name)
+{
+	for (auto& codec : axfs_codecs)
+	{
+		if (strcmp(codec.name, name) == 0)
+			return &codec;
+	}
+	return nullptr;
+}
+
+// default codec for a compression type, nullptr if none was built in
+static const axfs_codec* axfs_find_codec(u8 type)
+{
+	for (auto& codec : axfs_codecs)
+	{
+		if (codec.type == type)
+			return &codec;
+	}
+	return nullptr;
+}
+
+// where descriptors and region payloads come from while loading an image
+struct axfs_source
+{
+	FILE* file = nullptr;
+	const axfs_mapping* image = nullptr;
+	uint64_t size = 0;	/* of the image, reads past it fail */
+	bool lazy = false;	/* leave payloads to axfs_region::getData */
+	const axfs_codec* codec = nullptr;	/* set before axfs::load to pick a backend, else the image's default */
+	bool verbose = true;	/* print regions and superblock while loading */
+	mutable std::mutex lock;	/* file position is shared by all readers, Windows only */
+
+	bool contains(uint64_t offset, uint64_t len) const
+	{
+		return offset <= size && len <= size - offset;
+	}
+
+	// false if the bytes are not all in the image
+	bool read(void* dst, uint64_t offset, uint64_t len) const
+	{
+		if (!contains(offset, len))
+			return false;
+		if (image)
+		{
+			memcpy(dst, image->address(offset), (size_t) len);
+		}
+		else
+		{
+#ifdef _WIN32
+			std::lock_guard<std::mutex> guard(lock);
+			_fseeki64(file, (__int64) offset, SEEK_SET);
+			return len == 0 || fread(dst, (size_t) len, 1, file) == 1;
+#else
+			// positioned reads share the descriptor without the lock
+			int fd = fileno(file);
+			while (len > 0)
+			{
+				ssize_t got = pread(fd, dst, (size_t) len, (off_t) offset);
+				if (got < 0 && errno == EINTR)
+					continue;
+				if (got <= 0)
+					return false;
+				dst = (u8*) dst + got;
+				offset += (uint64_t) got;
+				len -= (uint64_t) got;
+			}
+#endif
+		}
+		return true;
+	}
+};
+
+struct axfs_region : public axfs_region_desc_onmedia
+{
+	mutable void* data;
+	bool mapped;	/* data points into an axfs_mapping and is not ours to free */
+	mutable std::atomic<const axfs_source*> source;	/* set while the payload has not been fetched yet */
+	mutable std::mutex fetchLock;
+	mutable int fetchResult = AXFS_OK;
+
+	void* expanded;	/* optional native-width copy of the table, see expand() */
+
+	axfs_region()
+		: data(nullptr), mapped(false), source(nullptr), expanded(nullptr)
+	{ }
+
+	~axfs_region()
+	{
+		if (!mapped)
+			free(data);
+		free(expanded);
+	}
+
+	// payload of the region, read from the image the first time it is needed
+	void* getData() const
+	{
+		auto result = prefetch();
+		assert(result == AXFS_OK);
+		(void) result;
+		return data;
+	}
+
+	// as getData, but nullptr if the payload could not be read
+	void* tryGetData() const
+	{
+		return prefetch() == AXFS_OK ? data : nullptr;
+	}
+
+	// fetch the payload now if it has not been yet, AXFS_OK or why it failed
+	int prefetch() const
+	{
+		if (source.load(std::memory_order_acquire))
+		{
+			std::lock_guard<std::mutex> guard(fetchLock);
+			if (auto from = source.load(std::memory_order_relaxed))
+			{
+				fetchResult = fetch(*from);
+				source.store(nullptr, std::memory_order_release);
+			}
+		}
+		return fetchResult;
+	}
+
+	// read the payload into a heap buffer, inflating it if it is stored compressed
+	int fetch(const axfs_source& from) const
+	{
+		data = malloc((size_t) std::max((uint64_t) size, (uint64_t) 1));
+		if (!data)
+			return AXFS_ERR_NOMEM;
+		if (compressed_size == 0)
+			return from.read(data, fsoffset, size) ? AXFS_OK : AXFS_ERR_FORMAT;
+
+		// as in axfs_do_fill_data_ptrs, a compressed region is a single stream
+		if (!from.contains(fsoffset, compressed_size))
+			return AXFS_ERR_FORMAT;
+		void* packed = from.image ? from.image->address(fsoffset) : malloc((size_t) compressed_size);
+		if (!packed)
+			return AXFS_ERR_NOMEM;
+		int result = AXFS_OK;
+		if (!from.image && !from.read(packed, fsoffset, compressed_size))
+			result = AXFS_ERR_IO;
+		else if (from.codec->decode(data, size, packed, compressed_size) != (int64_t) size)
+			result = AXFS_ERR_CORRUPT;
+		if (!from.image)
+			free(packed);
+		return result;
+	}
+
+	// How table holds the entries: planar at a byte depth of 1 to 8, or one of
+	// the native widths of expand().  Unresolved until resolve() found them in
+	// memory, lookups then go through getData.
+	enum stitch_layout : u8 { AXFS_UNRESOLVED = 0, AXFS_EXPANDED_16 = 9, AXFS_EXPANDED_32, AXFS_EXPANDED_64 };
+
+	uint64_t split = 0;	/* bytes per plane */
+	u8 layout = AXFS_UNRESOLVED;
+	const u8* table = nullptr;	/* the entries once resolved */
+
+	// set up stitching for this table's byte depth, once the descriptor is known
+	void prepareStitch()
+	{
+		assert(table_byte_depth <= 8);
+		split = table_byte_depth ? size / table_byte_depth : 0;
+	}
+
+	// bytes per entry of the expanded table, 0 when expanding would not save anything
+	int expandedWidth() const
+	{
+		if (table_byte_depth <= 1)
+			return 0; // a single plane already is a native byte array
+		return table_byte_depth <= 2 ? 2 : table_byte_depth <= 4 ? 4 : 8;
+	}
+
+	uint64_t expandedSize() const
+	{
+		return max_index * expandedWidth();
+	}
+
+	// trade memory for lookups: decode the planes into a plain array so every
+	// stitch is a single load.  Not safe while other threads are reading.
+	// False when there is no memory for it, the table then stays planar.
+	bool expand()
+	{
+		auto width = expandedWidth();
+		if (!width || expanded)
+			return true;
+
+		void* expandedTable = malloc((size_t) expandedSize());
+		if (!expandedTable)
+			return false;
+		uint64_t chunk[1024];
+		for (uint64_t first = 0; first < max_index; first += 1024)
+		{
+			uint64_t count = std::min((uint64_t) max_index - first, (uint64_t) 1024);
+			axfs_bytetable_stitch_range(first, count, chunk);
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				switch (width)
+				{
+				case 2: ((uint16_t*)expandedTable)[first + i] = (uint16_t) chunk[i]; break;
+				case 4: ((uint32_t*)expandedTable)[first + i] = (uint32_t) chunk[i]; break;
+				case 8: ((uint64_t*)expandedTable)[first + i] = chunk[i]; break;
+				}
+			}
+		}
+		expanded = expandedTable;
+		table = (const u8*) expanded;
+		layout = width == 2 ? AXFS_EXPANDED_16 : width == 4 ? AXFS_EXPANDED_32 : AXFS_EXPANDED_64;
+		return true;
+	}
+
+	// Note where the entries are so lookups skip getData.  Only once the payload
+	// is in memory and before the region is shared between threads; lazily
+	// fetched regions stay unresolved.
+	void resolve()
+	{
+		if (source.load(std::memory_order_relaxed) || fetchResult != AXFS_OK || expanded)
+			return;
+		table = (const u8*) data;
+		layout = table_byte_depth;
+	}
+
+	// Inlined into the caller with no call or atomic on the way: a resolved
+	// table is a member load, the common one and two byte depths are tested
+	// for directly and deeper ones go through a switch of unrolled kernels
+	uint64_t axfs_bytetable_stitch(uint64_t index) const
+	{
+		assert(index < max_index);
+		const u8* t = table;
+		u8 depth = layout;
+		if (depth > 8)
+			return stitchExpanded(t, depth, index);
+		if (depth == AXFS_UNRESOLVED)
+			return stitchUnresolved(index);
+		if (depth <= 2)
+		{
+			uint64_t output = t[index];
+			if (depth == 2)
+				output |= (uint64_t) t[index + split] << 8;
+			return output;
+		}
+		return stitchAt(depth, t, split, index);
+	}
+
+	static uint64_t stitchAt(u8 depth, const u8* t, uint64_t split, uint64_t index)
+	{
+		switch (depth)
+		{
+		case 1: return stitchOneDepth<1>(t, split, index);
+		case 2: return stitchOneDepth<2>(t, split, index);
+		case 3: return stitchOneDepth<3>(t, split, index);
+		case 4: return stitchOneDepth<4>(t, split, index);
+		case 5: return stitchOneDepth<5>(t, split, index);
+		case 6: return stitchOneDepth<6>(t, split, index);
+		case 7: return stitchOneDepth<7>(t, split, index);
+		default: return stitchOneDepth<8>(t, split, index);
+		}
+	}
+
+	static uint64_t stitchExpanded(const u8* t, u8 layout, uint64_t index)
+	{
+		switch (layout)
+		{
+		case AXFS_EXPANDED_16: return ((const uint16_t*)t)[index];
+		case AXFS_EXPANDED_32: return ((const uint32_t*)t)[index];
+		default: return ((const uint64_t*)t)[index];
+		}
+	}
+
+	// lazily fetched, or a depth of 0
+	AXFS_NOINLINE uint64_t stitchUnresolved(uint64_t index) const
+	{
+		if (table_byte_depth == 0)
+			return 0;
+		return stitchAt(table_byte_depth, (const u8*) getData(), split, index);
+	}
+
+	// stitch the values [first, first + count) into out in one pass over the byte planes
+	void axfs_bytetable_stitch_range(uint64_t first, uint64_t count, uint64_t* out) const
+	{
+		assert(first + count <= max_index);
+		if (count == 0)
+			return;
+		u8 kind = layout;
+		const u8* t = table;
+		if (kind == AXFS_UNRESOLVED)
+		{
+			kind = table_byte_depth;
+			t = (const u8*) getData();
+		}
+		switch (kind)
+		{
+		case 1: stitchRangeDepth<1>(t, split, first, count, out); break;
+		case 2: stitchRangeDepth<2>(t, split, first, count, out); break;
+		case 3: stitchRangeDepth<3>(t, split, first, count, out); break;
+		case 4: stitchRangeDepth<4>(t, split, first, count, out); break;
+		case 5: stitchRangeDepth<5>(t, split, first, count, out); break;
+		case 6: stitchRangeDepth<6>(t, split, first, count, out); break;
+		case 7: stitchRangeDepth<7>(t, split, first, count, out); break;
+		case 8: stitchRangeDepth<8>(t, split, first, count, out); break;
+		case AXFS_EXPANDED_16: expandedRange<uint16_t>(t, first, count, out); break;
+		case AXFS_EXPANDED_32: expandedRange<uint32_t>(t, first, count, out); break;
+		case AXFS_EXPANDED_64: expandedRange<uint64_t>(t, first, count, out); break;
+		default: memset(out, 0, (size_t) count * sizeof(*out)); break;
+		}
+	}
+
+	template<typename T>
+	static void expandedRange(const u8* table, uint64_t first, uint64_t count, uint64_t* out)
+	{
+		for (uint64_t i = 0; i < count; ++i)
+			out[i] = ((const T*)table)[first + i];
+	}
+
+	// This is the old v1.9.1 AXFS version of axfs_bytetable_stitch, with the
+	// depth fixed at compile time so the plane loop unrolls into straight loads
+	template<int depth>
+	static uint64_t stitchOneDepth(const u8* table, uint64_t split, uint64_t index)
+	{
+		uint64_t output = 0;
+		for (int i = 0; i < depth; i++)
+			output |= (uint64_t)table[index + i * split] << (8 * i);
+		return output;
+	}
+
+	template<int depth>
+	static void stitchRangeDepth(const u8* table, uint64_t split, uint64_t first, uint64_t count, uint64_t* out)
+	{
+		uint64_t i = 0;
+#if defined(AXFS_SIMD_SSE2)
+		for (; i + 16 <= count; i += 16)
+			stitch16<depth>(table + first + i, split, out + i);
+#endif
+		for (; i < count; ++i)
+			out[i] = stitchOneDepth<depth>(table, split, first + i);
+	}
+
+#if defined(AXFS_SIMD_AVX2)
+	// widen 16 bytes of every plane to 64 bit lanes, 4 per ymm, and or them in at the plane's shift
+	template<int depth>
+	static void stitch16(const u8* table, uint64_t split, uint64_t* out)
+	{
+		__m256i acc0 = _mm256_setzero_si256();
+		__m256i acc1 = _mm256_setzero_si256();
+		__m256i acc2 = _mm256_setzero_si256();
+		__m256i acc3 = _mm256_setzero_si256();
+		for (int i = 0; i < depth; i++)
+		{
+			__m128i bytes = _mm_loadu_si128((const __m128i*)(table + i * split));
+			__m128i shift = _mm_cvtsi32_si128(8 * i);
+			acc0 = _mm256_or_si256(acc0, _mm256_sll_epi64(_mm256_cvtepu8_epi64(bytes), shift));
+			acc1 = _mm256_or_si256(acc1, _mm256_sll_epi64(_mm256_cvtepu8_epi64(_mm_srli_si128(bytes, 4)), shift));
+			acc2 = _mm256_or_si256(acc2, _mm256_sll_epi64(_mm256_cvtepu8_epi64(_mm_srli_si128(bytes, 8)), shift));
+			acc3 = _mm256_or_si256(acc3, _mm256_sll_epi64(_mm256_cvtepu8_epi64(_mm_srli_si128(bytes, 12)), shift));
+		}
+		_mm256_storeu_si256((__m256i*)(out + 0), acc0);
+		_mm256_storeu_si256((__m256i*)(out + 4), acc1);
+		_mm256_storeu_si256((__m256i*)(out + 8), acc2);
+		_mm256_storeu_si256((__m256i*)(out + 12), acc3);
+	}
+#elif defined(AXFS_SIMD_SSE2)
+	// interleave 16 bytes of every plane with zeros up to 64 bit lanes and or them in at the plane's shift
+	template<int depth>
+	static void stitch16(const u8* table, uint64_t split, uint64_t* out)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		__m128i acc[8];
+		for (auto& a : acc)
+			a = zero;
+		for (int i = 0; i < depth; i++)
+		{
+			__m128i bytes = _mm_loadu_si128((const __m128i*)(table + i * split));
+			__m128i shift = _mm_cvtsi32_si128(8 * i);
+			__m128i words[2] = { _mm_unpacklo_epi8(bytes, zero), _mm_unpackhi_epi8(bytes, zero) };
+			for (int w = 0; w < 2; w++)
+			{
+				__m128i dwords[2] = { _mm_unpacklo_epi16(words[w], zero), _mm_unpackhi_epi16(words[w], zero) };
+				for (int d = 0; d < 2; d++)
+				{
+					__m128i* a = &acc[w * 4 + d * 2];
+					a[0] = _mm_or_si128(a[0], _mm_sll_epi64(_mm_unpacklo_epi32(dwords[d], zero), shift));
+					a[1] = _mm_or_si128(a[1], _mm_sll_epi64(_mm_unpackhi_epi32(dwords[d], zero), shift));
+				}
+			}
+		}
+		for (int j = 0; j < 8; j++)
+			_mm_storeu_si128((__m128i*)(out + 2 * j), acc[j]);
+	}
+#endif
+
+};
+
+
+
+int loadRegion(const char* name, axfs_region& region, const axfs_source& source, uint64_t offset)
+{
+	if (!source.read(&region, offset, sizeof(axfs_region_desc_onmedia)))
+		return AXFS_ERR_FORMAT;
+	// every planar table entry must be inside the region
+	if (region.table_byte_depth > 8 || (region.table_byte_depth && region.max_index > region.size / region.table_byte_depth))
+		return AXFS_ERR_FORMAT;
+	if (!source.contains(region.fsoffset, region.compressed_size > 0 ? region.compressed_size : region.size))
+		return AXFS_ERR_FORMAT;
+	region.prepareStitch();
+
+	if (source.verbose)
+		printf("loadRegion %s: %" PRIu64 " bytes at %" PRIu64 " %dx%d\n", name, (uint64_t)region.size, (uint64_t)region.fsoffset, (uint32_t) region.max_index, (uint32_t) region.table_byte_depth);
+
+	if (region.compressed_size > 0 || source.lazy)
+	{
+		// inflated by axfs::load, or on first touch for lazy images
+		region.source = &source;
+		return AXFS_OK;
+	}
+
+	if (source.image)
+	{
+		// like an XIP region in axfs_do_fill_data_ptrs, just point into the image
+		region.data = source.image->address(region.fsoffset);
+		region.mapped = true;
+		region.resolve();
+		return AXFS_OK;
+	}
+
+	region.data = malloc((size_t) std::max((uint64_t) region.size, (uint64_t) 1));
+	if (!region.data)
+		return AXFS_ERR_NOMEM;
+	if (!source.read(region.data, region.fsoffset, region.size))
+		return AXFS_ERR_IO;
+	region.resolve();
+	return AXFS_OK;
+}
+
+#define AXFS_DEFAULT_CACHE_SIZE (4 << 20)
+
+#define AXFS_CACHE_SHARDS 16	/* at most, fewer when the budget holds fewer cblocks */
+
+// one lock stripe of the cblock cache, least recently used block evicted first
+struct axfs_cblock_cache_shard
+{
+	struct entry
+	{
+		uint64_t index;
+		std::shared_ptr<const void> data;
+	};
+
+	std::mutex lock;
+	std::list<entry> lru;	/* most recently used at the front */
+	std::unordered_map<uint64_t, std::list<entry>::iterator> blocks;
+	uint64_t capacity = 0;
+	uint64_t blockSize = 0;
+
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	uint64_t evictions = 0;
+};
+
+// decompressed cblocks, bounded in bytes and safe to share between threads.
+// Blocks are spread over independently locked shards so readers of different
+// cblocks rarely contend, and handed out by reference count so an eviction
+// never pulls a block out from under a reader still copying from it.  The
+// shards together never hold more than the budget; a budget of less than one
+// cblock caches nothing.
+struct axfs_cblock_cache
+{
+	axfs_cblock_cache_shard shards[AXFS_CACHE_SHARDS];
+	uint64_t shardCount = 1;
+
+	void init(uint64_t cacheBytes, uint64_t cblockSize)
+	{
+		// a shard needs room for one cblock at least, so tight budgets get fewer
+		shardCount = std::max(std::min(cacheBytes / std::max(cblockSize, (uint64_t) 1), (uint64_t) AXFS_CACHE_SHARDS), (uint64_t) 1);
+		for (uint64_t i = 0; i < AXFS_CACHE_SHARDS; ++i)
+		{
+			auto& shard = shards[i];
+			std::lock_guard<std::mutex> guard(shard.lock);
+			shard.lru.clear();
+			shard.blocks.clear();
+			shard.capacity = i < shardCount ? cacheBytes / shardCount : 0;
+			shard.blockSize = cblockSize;
+		}
+	}
+
+	axfs_cblock_cache_shard& shardFor(uint64_t index)
+	{
+		return shards[index % shardCount];
+	}
+
+	// returns the cached copy of a cblock, or nullptr if it has to be inflated
+	std::shared_ptr<const void> find(uint64_t index)
+	{
+		auto& shard = shardFor(index);
+		std::lock_guard<std::mutex> guard(shard.lock);
+		auto it = shard.blocks.find(index);
+		if (it == shard.blocks.end())
+		{
+			++shard.misses;
+			return nullptr;
+		}
+		++shard.hits;
+		shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+		return it->second->data;
+	}
+
+	// adds a freshly inflated cblock; if another thread got there first its copy wins
+	std::shared_ptr<const void> insert(uint64_t index, std::shared_ptr<const void> data)
+	{
+		auto& shard = shardFor(index);
+		std::lock_guard<std::mutex> guard(shard.lock);
+		auto it = shard.blocks.find(index);
+		if (it != shard.blocks.end())
+			return it->second->data;
+
+		if (shard.blockSize > shard.capacity)
+			return data; // the reader's reference is the only one
+		while ((shard.lru.size() + 1) * shard.blockSize > shard.capacity)
+		{
+			shard.blocks.erase(shard.lru.back().index);
+			shard.lru.pop_back();
+			++shard.evictions;
+		}
+		shard.lru.push_front(axfs_cblock_cache_shard::entry{ index, data });
+		shard.blocks[index] = shard.lru.begin();
+		return data;
+	}
+
+	void printStats()
+	{
+		uint64_t hits = 0, misses = 0, evictions = 0, used = 0, capacity = 0;
+		for (auto& shard : shards)
+		{
+			std::lock_guard<std::mutex> guard(shard.lock);
+			hits += shard.hits;
+			misses += shard.misses;
+			evictions += shard.evictions;
+			used += shard.lru.size() * shard.blockSize;
+			capacity += shard.capacity;
+		}
+		printf("cblock cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions, %" PRIu64 "/%" PRIu64 " bytes\n",
+			hits, misses, evictions, used, capacity);
+	}
+};
+
+struct axfs_path_index;
+
+struct axfs
+{
+	axfs_mapping image;	/* must outlive the regions that point into it */
+	axfs_source source;	/* stays open for regions that are still to be fetched */
+	axfs_super_onmedia superblock;
+	axfs_region strings;
+	axfs_region xip;
+	axfs_region compressed;
+	axfs_region byte_aligned;
+	axfs_region node_type;
+	axfs_region node_index;
+	axfs_region cnode_offset;
+	axfs_region cnode_index;
+	axfs_region banode_offset;
+	axfs_region cblock_offset;
+	axfs_region inode_file_size;
+	axfs_region inode_name_offset;
+	axfs_region inode_num_entries;
+	axfs_region inode_mode_index;
+	axfs_region inode_array_index;
+	axfs_region modes;
+	axfs_region uids;
+	axfs_region gids;
+	axfs_region cblock_codec;	/* only in AXFS_COMPRESSION_PER_CBLOCK images */
+
+	bool perCblockCodec = false;
+	const axfs_codec* cblockCodecs[AXFS_COMPRESSION_TYPES] = {};	/* decoder for each cblock tag */
+
+	mutable axfs_cblock_cache cache;	/* shared by all reads on this image */
+	std::shared_ptr<const axfs_path_index> pathIndex;	/* see indexPaths */
+	uint64_t tableBytes = 0;	/* set before load: memory for expanding lookup tables, see expandTables */
+
+	~axfs()
+	{
+		if (source.file)
+			fclose(source.file);
+	}
+
+	// AXFS_OK, or one of the AXFS_ERR_* codes of libaxfs.h
+	int load(const char* filename, axfs_load_mode mode = AXFS_LOAD_MMAP, uint64_t cacheBytes = AXFS_DEFAULT_CACHE_SIZE)
+	{
+		if (mode == AXFS_LOAD_MMAP)
+		{
+			if (!image.open(filename))
+				return AXFS_ERR_IO;
+			return loadMapped(cacheBytes);
+		}
+
+		fopen_s(&source.file, filename, "rb");
+		if (!source.file)
+			return AXFS_ERR_IO;
+#ifdef _WIN32
+		_fseeki64(source.file, 0, SEEK_END);
+		source.size = (uint64_t) _ftelli64(source.file);
+#else
+		struct stat st;
+		fstat(fileno(source.file), &st);
+		source.size = (uint64_t) st.st_size;
+#endif
+		source.lazy = mode == AXFS_LOAD_LAZY;
+		return loadSource(cacheBytes);
+	}
+
+	// load from image, once it has been opened or borrowed
+	int loadMapped(uint64_t cacheBytes = AXFS_DEFAULT_CACHE_SIZE)
+	{
+		source.image = &image;
+		source.size = image.size;
+		return loadSource(cacheBytes);
+	}
+
+	int loadSource(uint64_t cacheBytes)
+	{
+		if (!source.read(&superblock, 0, sizeof(superblock)) || superblock.magic != 0x48A0E4CD)
+			return AXFS_ERR_FORMAT;
+		if (superblock.cblock_size == 0)
+			return AXFS_ERR_FORMAT;
+		perCblockCodec = superblock.compression_type == AXFS_COMPRESSION_PER_CBLOCK;
+		u8 regionType = perCblockCodec ? AXFS_COMPRESSION_ZLIB : superblock.compression_type;
+		// a backend picked before load is kept for the compression type it decodes
+		const axfs_codec* preferred = source.codec;
+		if (!source.codec || source.codec->type != regionType)
+			source.codec = axfs_find_codec(regionType);
+		if (!source.codec)
+		{
+			if (source.verbose)
+				printf("no decoder built in for %s compression (%d)\n", axfs_compression_name(regionType), regionType);
+			return AXFS_ERR_UNSUPPORTED;
+		}
+		for (u8 type = 0; type < AXFS_COMPRESSION_TYPES; ++type)
+			cblockCodecs[type] = preferred && type == preferred->type ? preferred : axfs_find_codec(type);
+
+		const struct
+		{
+			const char* name;
+			axfs_region* region;
+			uint64_t offset;
+		} regions[] = {
+			{ "xip", &xip, superblock.xip },
+			{ "strings", &strings, superblock.strings },
+			{ "compressed", &compressed, superblock.compressed },
+			{ "byte_aligned", &byte_aligned, superblock.byte_aligned },
+			{ "node_type", &node_type, superblock.node_type },
+			{ "node_index", &node_index, superblock.node_index },
+			{ "cnode_offset", &cnode_offset, superblock.cnode_offset },
+			{ "cnode_index", &cnode_index, superblock.cnode_index },
+			{ "banode_offset", &banode_offset, superblock.banode_offset },
+			{ "cblock_offset", &cblock_offset, superblock.cblock_offset },
+			{ "inode_file_size", &inode_file_size, superblock.inode_file_size },
+			{ "inode_name_offset", &inode_name_offset, superblock.inode_name_offset },
+			{ "inode_num_entries", &inode_num_entries, superblock.inode_num_entries },
+			{ "inode_mode_index", &inode_mode_index, superblock.inode_mode_index },
+			{ "inode_array_index", &inode_array_index, superblock.inode_array_index },
+			{ "modes", &modes, superblock.modes },
+			{ "uids", &uids, superblock.uids },
+			{ "gids", &gids, superblock.gids },
+			{ "cblock_codec", &cblock_codec, superblock.cblock_codec },
+		};
+		for (auto& r : regions)
+		{
+			if (r.region == &cblock_codec && !perCblockCodec)
+				continue;
+			if (int result = loadRegion(r.name, *r.region, source, r.offset))
+				return result;
+		}
+
+		int result = AXFS_OK;
+		if (!source.lazy)
+			result = inflateRegions();
+
+		if (source.file && !source.lazy)
+		{
+			fclose(source.file);
+			source.file = nullptr;
+		}
+		if (result != AXFS_OK)
+			return result;
+
+		if (source.verbose)
+			printSuperblock();
+
+		// lazily loaded tables are expanded by nobody, that would fetch them all
+		if (tableBytes && !source.lazy)
+			expandTables(tableBytes);
+
+		cache.init(cacheBytes, superblock.cblock_size);
+		return AXFS_OK;
+	}
+
+	void printSuperblock() const
+	{
+		printf("%" PRIu64 " files\n", (uint64_t)superblock.files);
+		printf("version %d.%d.%d\n", superblock.version_major, superblock.version_minor, superblock.version_sub);
+		printf("compression %s (%d), decoded by %s\n", axfs_compression_name(superblock.compression_type), superblock.compression_type, source.codec->name);
+		printf("cblock size %d, %" PRIu64 " cblocks\n", (uint32_t) superblock.cblock_size, getCblockCount());
+		if (perCblockCodec)
+		{
+			uint64_t counts[256] = {};
+			for (uint64_t i = 0; i < getCblockCount(); ++i)
+				++counts[getCblockType(i)];
+			for (int type = 0; type < 256; ++type)
+			{
+				if (counts[type])
+					printf("\t%" PRIu64 " %s cblocks\n", counts[type], axfs_compression_name((u8) type));
+			}
+		}
+		printf("image size %" PRIu64 ", mmap size %" PRIu64 ", %" PRIu64 " nodes\n", (uint64_t) superblock.size, (uint64_t) superblock.mmap_size, (uint64_t) superblock.blocks);
+	}
+
+	// Expand the hottest lookup tables into native arrays, smallest first, for as
+	// long as they fit into budget bytes.  Returns the bytes spent, verbose lists
+	// the choice and the bytes each costs over its planes on media.  Call before
+	// sharing the image between threads.
+	uint64_t expandTables(uint64_t budget)
+	{
+		struct candidate
+		{
+			const char* name;
+			axfs_region* region;
+		};
+		candidate candidates[] = {
+			{ "node_type", &node_type },
+			{ "node_index", &node_index },
+			{ "inode_array_index", &inode_array_index },
+			{ "inode_file_size", &inode_file_size },
+			{ "cnode_index", &cnode_index },
+		};
+		std::sort(std::begin(candidates), std::end(candidates), [](const candidate& a, const candidate& b) {
+			return a.region->expandedSize() < b.region->expandedSize();
+		});
+
+		uint64_t spent = 0;
+		uint64_t overhead = 0;
+		for (auto& c : candidates)
+		{
+			uint64_t extra = c.region->expandedSize();
+			if (extra == 0 || c.region->expanded)
+				continue;
+			if (spent + extra > budget || !c.region->expand())
+			{
+				if (source.verbose)
+					printf("%s: %" PRIu64 " bytes not spent, left planar\n", c.name, extra);
+				continue;
+			}
+			spent += extra;
+			uint64_t onMedia = c.region->max_index * c.region->table_byte_depth;
+			overhead += extra - onMedia;
+			if (source.verbose)
+			{
+				printf("%s: %" PRIu64 " entries from %d to %d bytes, %" PRIu64 " bytes more than on media\n", c.name,
+					(uint64_t) c.region->max_index, (int) c.region->table_byte_depth, c.region->expandedWidth(), extra - onMedia);
+			}
+		}
+		if (source.verbose)
+			printf("%" PRIu64 " of %" PRIu64 " table bytes spent, %" PRIu64 " more than on media\n", spent, budget, overhead);
+		return spent;
+	}
+
+	// compressed metadata regions are independent zlib streams, inflate them all at once
+	int inflateRegions()
+	{
+		axfs_region* regions[] = {
+			&strings, &xip, &compressed, &byte_aligned, &node_type, &node_index,
+			&cnode_offset, &cnode_index, &banode_offset, &cblock_offset,
+			&inode_file_size, &inode_name_offset, &inode_num_entries,
+			&inode_mode_index, &inode_array_index, &modes, &uids, &gids, &cblock_codec,
+		};
+
+		std::vector<std::thread> workers;
+		for (auto region : regions)
+		{
+			if (region->source)
+				workers.emplace_back([region] { region->prefetch(); });
+		}
+		for (auto& worker : workers)
+			worker.join();
+		for (auto region : regions)
+		{
+			if (int result = region->prefetch())
+				return result;
+			region->resolve();
+		}
+		return AXFS_OK;
+	}
+
+	// Check every table entry the reader follows against the size of what it points
+	// into, so a damaged image fails to open instead of being read out of bounds.
+	// The contents of compressed data are only checked as they are inflated.
+	int verify() const
+	{
+		uint64_t files = superblock.files;
+		const axfs_region* inodeTables[] = {
+			&inode_file_size, &inode_name_offset, &inode_num_entries, &inode_mode_index, &inode_array_index,
+		};
+		for (auto table : inodeTables)
+		{
+			if (files == 0 || table->max_index < files)
+				return AXFS_ERR_FORMAT;
+		}
+		const u8* names = (const u8*) strings.getData();
+		if (strings.size == 0 || names[strings.size - 1] != 0)
+			return AXFS_ERR_FORMAT;
+
+		// cblocks are back to back in the compressed region
+		uint64_t cblocks = getCblockCount();
+		std::vector<uint64_t> cblockOffsets((size_t) cblocks + 1);
+		if (cblocks > 0)
+			cblock_offset.axfs_bytetable_stitch_range(0, cblocks + 1, cblockOffsets.data());
+		for (uint64_t i = 0; i < cblocks; ++i)
+		{
+			if (cblockOffsets[i] > cblockOffsets[i + 1])
+				return AXFS_ERR_FORMAT;
+		}
+		if (cblockOffsets[(size_t) cblocks] > compressed.size)
+			return AXFS_ERR_FORMAT;
+		if (perCblockCodec && cblock_codec.max_index < cblocks)
+			return AXFS_ERR_FORMAT;
+
+		std::vector<uint64_t> sizes((size_t) files);
+		std::vector<uint64_t> nameOffsets((size_t) files);
+		std::vector<uint64_t> entries((size_t) files);
+		std::vector<uint64_t> modeIndices((size_t) files);
+		std::vector<uint64_t> arrayIndices((size_t) files);
+		inode_file_size.axfs_bytetable_stitch_range(0, files, sizes.data());
+		inode_name_offset.axfs_bytetable_stitch_range(0, files, nameOffsets.data());
+		inode_num_entries.axfs_bytetable_stitch_range(0, files, entries.data());
+		inode_mode_index.axfs_bytetable_stitch_range(0, files, modeIndices.data());
+		inode_array_index.axfs_bytetable_stitch_range(0, files, arrayIndices.data());
+
+		uint64_t modeCount = std::min(std::min((uint64_t) modes.max_index, (uint64_t) uids.max_index), (uint64_t) gids.max_index);
+		uint64_t nodes = std::min((uint64_t) node_type.max_index, (uint64_t) node_index.max_index);
+		for (uint64_t id = 0; id < files; ++id)
+		{
+			if (nameOffsets[id] >= strings.size || modeIndices[id] >= modeCount)
+				return AXFS_ERR_FORMAT;
+			auto mode = modes.axfs_bytetable_stitch(modeIndices[id]);
+			uint64_t first = arrayIndices[id];
+			if (S_ISDIR(mode))
+			{
+				// entries come after their directory, so walking the tree always ends
+				if (entries[id] > 0 && (first <= id || first > files || entries[id] > files - first))
+					return AXFS_ERR_FORMAT;
+			}
+			else if (S_ISREG(mode) || S_ISLNK(mode))
+			{
+				uint64_t pages = (sizes[id] + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+				if (pages > 0 && (first > nodes || pages > nodes - first))
+					return AXFS_ERR_FORMAT;
+				if (int result = verifyPages(first, pages, sizes[id], cblockOffsets))
+					return result;
+			}
+		}
+		return AXFS_OK;
+	}
+
+	// the nodes of a file's pages are all inside their regions
+	int verifyPages(uint64_t first, uint64_t pages, uint64_t fileSize, const std::vector<uint64_t>& cblockOffsets) const
+	{
+		uint64_t cblocks = cblockOffsets.size() - 1;
+		uint64_t types[AXFS_STITCH_BATCH];
+		uint64_t indices[AXFS_STITCH_BATCH];
+		for (uint64_t done = 0; done < pages;)
+		{
+			uint64_t count = std::min(pages - done, (uint64_t) AXFS_STITCH_BATCH);
+			node_type.axfs_bytetable_stitch_range(first + done, count, types);
+			node_index.axfs_bytetable_stitch_range(first + done, count, indices);
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				uint64_t bytes = std::min(fileSize - ((done + i) << PAGE_SHIFT), (uint64_t) PAGE_CACHE_SIZE);
+				uint64_t index = indices[i];
+				switch (types[i])
+				{
+				case 0: // XIP
+					if (index >= xip.size >> PAGE_SHIFT)
+						return AXFS_ERR_FORMAT;
+					break;
+				case 2: // Byte_aligned
+				{
+					if (index >= banode_offset.max_index)
+						return AXFS_ERR_FORMAT;
+					uint64_t offset = getByteAlignedOffset(index);
+					if (offset > byte_aligned.size || bytes > byte_aligned.size - offset)
+						return AXFS_ERR_FORMAT;
+					break;
+				}
+				case 1: // Compressed
+				{
+					if (index >= cnode_offset.max_index || index >= cnode_index.max_index)
+						return AXFS_ERR_FORMAT;
+					uint64_t cnodeIndex = cnode_index.axfs_bytetable_stitch(index);
+					if (cnodeIndex >= cblocks)
+						return AXFS_ERR_FORMAT;
+					uint64_t cnodeOffset = cnode_offset.axfs_bytetable_stitch(index);
+					// a stored cblock is read in place, the others inflate into cblock_size bytes
+					uint64_t limit = perCblockCodec && getCblockType(cnodeIndex) == AXFS_COMPRESSION_STORED ?
+						cblockOffsets[(size_t) cnodeIndex + 1] - cblockOffsets[(size_t) cnodeIndex] : (uint64_t) superblock.cblock_size;
+					if (cnodeOffset > limit || bytes > limit - cnodeOffset)
+						return AXFS_ERR_FORMAT;
+					break;
+				}
+				default:
+					return AXFS_ERR_FORMAT;
+				}
+			}
+			done += count;
+		}
+		return AXFS_OK;
+	}
+
+	const char* getName(uint64_t id) const
+	{
+		auto offset = inode_name_offset.axfs_bytetable_stitch(id);
+		return (const char*)((const u8*)strings.getData() + offset);
+	};
+
+	uint64_t getFileSize(uint64_t id) const
+	{
+		return inode_file_size.axfs_bytetable_stitch(id);
+	};
+
+	uint64_t getMode(uint64_t id)const
+	{
+		auto modeIndex = inode_mode_index.axfs_bytetable_stitch(id);
+		return modes.axfs_bytetable_stitch(modeIndex);
+	};
+
+	uint64_t getUid(uint64_t id) const
+	{
+		return uids.axfs_bytetable_stitch(inode_mode_index.axfs_bytetable_stitch(id));
+	}
+
+	uint64_t getGid(uint64_t id) const
+	{
+		return gids.axfs_bytetable_stitch(inode_mode_index.axfs_bytetable_stitch(id));
+	}
+
+	uint64_t getNumEntries(uint64_t id)const
+	{
+		return inode_num_entries.axfs_bytetable_stitch(id);
+	};
+
+	uint64_t getArrayIndex(uint64_t id)const
+	{
+		return inode_array_index.axfs_bytetable_stitch(id);
+	};
+
+	uint64_t getNodeType(uint64_t id) const
+	{
+		return node_type.axfs_bytetable_stitch(id);
+	}
+
+	uint64_t getByteAlignedOffset(uint64_t id) const
+	{
+		return banode_offset.axfs_bytetable_stitch(id);
+	}
+
+
+	static void* offsetAddress(void* addr, uint64_t offset)
+	{
+		return ((void*)((uintptr_t)(addr)+(offset)));
+	}
+
+	uint64_t getCblockCount() const
+	{
+		return cblock_offset.max_index > 0 ? cblock_offset.max_index - 1 : 0;
+	}
+
+	// AXFS_COMPRESSION_* a cblock is stored with
+	u8 getCblockType(uint64_t cnodeIndex) const
+	{
+		if (!perCblockCodec)
+			return superblock.compression_type;
+		return (u8) cblock_codec.axfs_bytetable_stitch(cnodeIndex);
+	}
+
+	// inflate a whole cblock into out, which must hold cblock_size bytes, returns its length
+	uint64_t inflateCblock(uint64_t cnodeIndex, void* out) const
+	{
+		auto result = tryInflateCblock(cnodeIndex, out);
+		assert(result >= 0);
+		return (uint64_t) result;
+	}
+
+	// as inflateCblock, but -1 if the cblock cannot be decoded
+	int64_t tryInflateCblock(uint64_t cnodeIndex, void* out) const
+	{
+		uint64_t srcOffset = cblock_offset.axfs_bytetable_stitch(cnodeIndex);
+		uint64_t len = cblock_offset.axfs_bytetable_stitch(cnodeIndex + 1) - srcOffset;
+		u8 type = getCblockType(cnodeIndex);
+		const axfs_codec* codec = type < AXFS_COMPRESSION_TYPES ? cblockCodecs[type] : nullptr;
+		if (!codec)
+		{
+			if (source.verbose)
+				printf("cblock %" PRIu64 ": no decoder built in for %s compression (%d)\n", cnodeIndex, axfs_compression_name(type), type);
+			return -1;
+		}
+		void* packed = compressed.tryGetData();
+		if (!packed)
+			return -1;
+		auto result = codec->decode(out, superblock.cblock_size, offsetAddress(packed, srcOffset), len);
+		return result >= 0 ? result : -1;
+	}
+
+	// start of a node's page, nullptr if it cannot be read; hold keeps an inflated
+	// cblock alive while it is read
+	const void* getNodeData(uint64_t type, uint64_t nodeIndex, std::shared_ptr<const void>& hold) const
+	{
+		switch (type)
+		{
+		case 0: // XIP
+		{
+			void* data = xip.tryGetData();
+			return data ? offsetAddress(data, nodeIndex << PAGE_SHIFT) : nullptr;
+		}
+		case 2: // Byte_aligned
+		{
+			void* data = byte_aligned.tryGetData();
+			return data ? offsetAddress(data, getByteAlignedOffset(nodeIndex)) : nullptr;
+		}
+		case 1: // Compressed
+		{
+			uint64_t cnodeOffset = cnode_offset.axfs_bytetable_stitch(nodeIndex);
+			uint64_t cnodeIndex = cnode_index.axfs_bytetable_stitch(nodeIndex);
+			if (perCblockCodec && getCblockType(cnodeIndex) == AXFS_COMPRESSION_STORED)
+			{
+				// a stored cblock is read in place, no inflate and no cache entry
+				void* data = compressed.tryGetData();
+				return data ? offsetAddress(data, cblock_offset.axfs_bytetable_stitch(cnodeIndex) + cnodeOffset) : nullptr;
+			}
+			hold = cache.find(cnodeIndex);
+			if (!hold)
+			{
+				// inflate outside of any lock, readers of other cblocks carry on meanwhile
+				std::shared_ptr<void> buffer(malloc(superblock.cblock_size), free);
+				if (!buffer || tryInflateCblock(cnodeIndex, buffer.get()) < 0)
+					return nullptr;
+				hold = cache.insert(cnodeIndex, buffer);
+			}
+			return offsetAddress((void*)hold.get(), cnodeOffset);
+		}
+		default:
+			return nullptr;
+		}
+	}
+
+	// end of the run of XIP pages starting at first whose nodes are stored back to
+	// back in the xip region, so the whole run can be handled as one block
+	static uint64_t findXipRun(const uint64_t* types, const uint64_t* indices, uint64_t first, uint64_t count)
+	{
+		uint64_t end = first + 1;
+		while (end < count && types[end] == 0 && indices[end] == indices[end - 1] + 1)
+			++end;
+		return end;
+	}
+
+	// copy [start, start + length) of a file to data, clipped to its size; nullptr
+	// if a page could not be read
+	void* readFile(uint64_t id, void* data, uint64_t start, uint64_t length) const
+	{
+		uint64_t fileSize = getFileSize(id);
+		if (start >= fileSize)
+			return data;
+
+		length = std::min(fileSize - start, length);
+
+		uint64_t arrayIndex = getArrayIndex(id) + (start >> PAGE_SHIFT);
+		uint64_t pageOffset = start & (PAGE_CACHE_SIZE - 1);
+		uint64_t offset = 0;
+		uint64_t types[AXFS_STITCH_BATCH];
+		uint64_t indices[AXFS_STITCH_BATCH];
+		while (length > 0)
+		{
+			// node types and indices of the next run of pages in one pass each
+			uint64_t pages = std::min((pageOffset + length + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT, (uint64_t) AXFS_STITCH_BATCH);
+			node_type.axfs_bytetable_stitch_range(arrayIndex, pages, types);
+			node_index.axfs_bytetable_stitch_range(arrayIndex, pages, indices);
+
+			for (uint64_t i = 0; i < pages;)
+			{
+				std::shared_ptr<const void> hold;
+				const void* src = getNodeData(types[i], indices[i], hold);
+				if (!src)
+					return nullptr;
+				uint64_t run = types[i] == 0 ? findXipRun(types, indices, i, pages) - i : 1;
+				uint64_t len = std::min((run << PAGE_SHIFT) - pageOffset, length);
+				memcpy(offsetAddress(data, offset), offsetAddress((void*)src, pageOffset), (size_t) len);
+				length -= len;
+				offset += len;
+				pageOffset = 0;
+				i += run;
+			}
+			arrayIndex += pages;
+		}
+
+		return data;
+	}
+
+	void printInfo(uint64_t id) const
+	{
+		uint64_t arrayIndex = getArrayIndex(id);
+		uint64_t last = (getFileSize(id) + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+		std::vector<uint64_t> types((size_t) last);
+		node_type.axfs_bytetable_stitch_range(arrayIndex, last, types.data());
+		for (auto type : types)
+		{
+			switch (type)
+			{
+			case 0: // XIP
+				printf("X");
+				break;
+			case 1: // Compressed
+				printf("c");
+				break;
+			case 2: // bytes
+				printf("b");
+				break;
+			default:
+				assert(false);
+				break;
+			}
+		}
+
+		printf("\n");
+	}
+
+	void ls(uint64_t id, bool recursive = true, int level = 0) const
+	{
+		uint64_t numFiles = getNumEntries(id);
+		uint64_t first = getArrayIndex(id);
+
+		// the entries of a directory are consecutive inodes, fetch their metadata in bulk
+		std::vector<uint64_t> nameOffsets((size_t) numFiles);
+		std::vector<uint64_t> modeIndices((size_t) numFiles);
+		std::vector<uint64_t> sizes((size_t) numFiles);
+		inode_name_offset.axfs_bytetable_stitch_range(first, numFiles, nameOffsets.data());
+		inode_mode_index.axfs_bytetable_stitch_range(first, numFiles, modeIndices.data());
+		inode_file_size.axfs_bytetable_stitch_range(first, numFiles, sizes.data());
+
+		for (uint64_t i = 0; i < numFiles; ++i)
+		{
+			printf("%3" PRIu64 ":", first + i);
+			for (int j = 0; j < level; ++j)
+				printf("\t");
+			const char* name = (const char*)strings.getData() + nameOffsets[i];
+			auto mode = modes.axfs_bytetable_stitch(modeIndices[i]);
+			if (S_ISDIR(mode))
+			{
+				printf("%s/\n", name);
+				if (recursive)
+				{
+					ls(first + i, recursive, level + 1);
+				}
+			}
+			else if (S_ISLNK(mode))
+			{
+				char linkName[1024];
+				uint64_t size = std::min(sizes[i], (uint64_t) sizeof(linkName) - 1);
+				readFile(first + i, linkName, 0, size);
+				linkName[size] = 0;
+				printf("%s -> %s\n", name, linkName);
+			}
+			else if (S_ISREG(mode))
+			{
+				printf("%s\t%" PRIu64 " ", name, sizes[i]);
+				printInfo(first + i);
+			}
+			else
+			{
+				printf("%s?\n", name);
+			}
+		}
+	};
+
+	uint64_t getNodeIndex(uint64_t id) const
+	{
+		return node_index.axfs_bytetable_stitch(id);
+	};
+
+	// compare a directory entry name with a path component that is not NUL terminated
+	static int compareName(const char* name, const char* component, size_t length)
+	{
+		int result = strncmp(name, component, length);
+		if (result == 0 && name[length] != 0)
+			result = 1;
+		return result;
+	}
+
+	// Find a name in directory dir.  Directories are alpha sorted, so unlike the
+	// linear scan in axfs_lookup this bisects [array index, + num entries).
+	uint64_t lookupEntry(uint64_t dir, const char* component, size_t length) const
+	{
+		uint64_t low = getArrayIndex(dir);
+		uint64_t high = low + getNumEntries(dir);
+		while (low < high)
+		{
+			uint64_t middle = low + (high - low) / 2;
+			int result = compareName(getName(middle), component, length);
+			if (result == 0)
+				return middle;
+			if (result < 0)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+		return AXFS_NO_INODE;
+	}
+
+	// Resolve an absolute or root relative path to an inode, AXFS_NO_INODE if it
+	// does not exist.  Symbolic links are not followed.  Goes through the path
+	// index once indexPaths has built one, else through searchPath.
+	uint64_t lookup(const char* path) const;
+
+	// Index every path for lookup.  Reads all names, so only after load and,
+	// for images that are not trusted, verify.  Not safe during lookups.
+	void indexPaths(unsigned threads);
+
+	// lookup by bisecting the directories on the path one component at a time
+	uint64_t searchPath(const char* path) const
+	{
+		std::vector<uint64_t> parents;
+		uint64_t id = 0;
+		while (*path)
+		{
+			const char* end = strchr(path, '/');
+			size_t length = end ? (size_t)(end - path) : strlen(path);
+
+			if (length == 0 || (length == 1 && path[0] == '.'))
+			{
+				// empty component or "."
+			}
+			else if (length == 2 && path[0] == '.' && path[1] == '.')
+			{
+				if (!parents.empty())
+				{
+					id = parents.back();
+					parents.pop_back();
+				}
+			}
+			else
+			{
+				if (!S_ISDIR(getMode(id)))
+					return AXFS_NO_INODE;
+				uint64_t entry = lookupEntry(id, path, length);
+				if (entry == AXFS_NO_INODE)
+					return AXFS_NO_INODE;
+				parents.push_back(id);
+				id = entry;
+			}
+
+			path += length;
+			if (*path == '/')
+				++path;
+		}
+		return id;
+	}
+
+};
+
+// a view of consecutive file bytes, straight into the image for XIP and byte
+// aligned pages or into a cached cblock for compressed ones
+struct axfs_span
+{
+	const void* data;
+	uint64_t length;
+	std::shared_ptr<const void> hold;	/* keeps a cached cblock alive while the span is in use */
+};
+
+// Walks [start, start + length) of a file yielding spans instead of copying.
+// Pages whose XIP nodes are physically adjacent come back as a single span.
+//
+//	axfs_span_reader reader(fs, id);
+//	axfs_span span;
+//	while (reader.next(span))
+//		consume(span.data, span.length);
+struct axfs_span_reader
+{
+	const axfs& fs;
+	uint64_t arrayIndex = 0;	/* node of the next page */
+	uint64_t pageOffset = 0;	/* offset into the next page */
+	uint64_t remaining = 0;
+	uint64_t types[AXFS_STITCH_BATCH];
+	uint64_t indices[AXFS_STITCH_BATCH];
+	uint64_t position = 0;	/* next unused entry of types and indices */
+	uint64_t count = 0;
+	bool failed = false;	/* a page could not be read, next stopped early */
+
+	axfs_span_reader(const axfs& fs, uint64_t id, uint64_t start = 0, uint64_t length = (uint64_t)-1)
+		: fs(fs)
+	{
+		uint64_t fileSize = fs.getFileSize(id);
+		if (start >= fileSize)
+			return;
+		remaining = std::min(fileSize - start, length);
+		arrayIndex = fs.getArrayIndex(id) + (start >> PAGE_SHIFT);
+		pageOffset = start & (PAGE_CACHE_SIZE - 1);
+	}
+
+	// stitch the node entries of the next batch of pages once the current one is used up
+	bool fill()
+	{
+		if (position < count)
+			return true;
+		if (remaining == 0)
+			return false;
+		count = std::min((pageOffset + remaining + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT, (uint64_t) AXFS_STITCH_BATCH);
+		fs.node_type.axfs_bytetable_stitch_range(arrayIndex, count, types);
+		fs.node_index.axfs_bytetable_stitch_range(arrayIndex, count, indices);
+		position = 0;
+		return true;
+	}
+
+	// take the next page, returns the bytes of it that belong to the read
+	uint64_t advance()
+	{
+		uint64_t len = std::min((uint64_t) PAGE_CACHE_SIZE - pageOffset, remaining);
+		remaining -= len;
+		pageOffset = 0;
+		++arrayIndex;
+		++position;
+		return len;
+	}
+
+	bool next(axfs_span& span)
+	{
+		if (!fill())
+			return false;
+
+		uint64_t type = types[position];
+		uint64_t nodeIndex = indices[position];
+		span.hold.reset();
+		const void* page = fs.getNodeData(type, nodeIndex, span.hold);
+		if (!page)
+		{
+			failed = true;
+			remaining = 0;
+			return false;
+		}
+		span.data = axfs::offsetAddress((void*)page, pageOffset);
+		span.length = advance();
+
+		if (type == 0) // XIP
+		{
+			// xip pages are stored back to back, carry on while the nodes are too,
+			// across batches as well
+			while (fill() && types[position] == 0 && indices[position] == nodeIndex + 1)
+			{
+				uint64_t end = axfs::findXipRun(types, indices, position, count);
+				nodeIndex = indices[end - 1];
+				uint64_t bytes = std::min((end - position) << PAGE_SHIFT, remaining);
+				remaining -= bytes;
+				span.length += bytes;
+				arrayIndex += end - position;
+				position = end;
+			}
+		}
+		return true;
+	}
+};
+
+// fixed set of worker threads, each with its own task deque.  A worker takes
+// tasks from the front of its own deque and, once that runs dry, steals from
+// the back of the others.  All tasks are pushed before run().
+struct axfs_work_pool
+{
+	struct queue
+	{
+		std::mutex lock;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	std::vector<std::unique_ptr<queue>> queues;
+	size_t next = 0;
+
+	explicit axfs_work_pool(unsigned threads)
+	{
+		threads = std::max(threads, 1u);
+		for (unsigned i = 0; i < threads; ++i)
+			queues.emplace_back(new queue);
+	}
+
+	void push(std::function<void()> task)
+	{
+		queues[next++ % queues.size()]->tasks.push_back(std::move(task));
+	}
+
+	bool take(size_t self, std::function<void()>& task)
+	{
+		for (size_t i = 0; i < queues.size(); ++i)
+		{
+			auto& q = *queues[(self + i) % queues.size()];
+			std::lock_guard<std::mutex> guard(q.lock);
+			if (q.tasks.empty())
+				continue;
+			if (i == 0)
+			{
+				task = std::move(q.tasks.front());
+				q.tasks.pop_front();
+			}
+			else
+			{
+				task = std::move(q.tasks.back());
+				q.tasks.pop_back();
+			}
+			return true;
+		}
+		return false;
+	}
+
+	void run()
+	{
+		std::vector<std::thread> workers;
+		for (size_t i = 0; i < queues.size(); ++i)
+		{
+			workers.emplace_back([this, i] {
+				std::function<void()> task;
+				while (take(i, task))
+					task();
+			});
+		}
+		for (auto& worker : workers)
+			worker.join();
+	}
+};
+
+// Open-time path index: a flat open addressing table from the hash of a full
+// path to its inode.  Path hashes are chained, hash(parent path) mixed with
+// hash(name), so a path is resolved with a single probe and then confirmed by
+// walking the parent links back up to the root comparing names.
+struct axfs_path_index
+{
+	struct slot
+	{
+		std::atomic<uint64_t> key;	/* 0 marks an empty slot */
+		uint64_t inode;
+	};
+
+	const axfs& fs;
+	std::unique_ptr<slot[]> slots;
+	uint64_t mask = 0;
+	std::vector<uint64_t> parents;	/* indexed by inode */
+
+	explicit axfs_path_index(const axfs& fs)
+		: fs(fs)
+	{ }
+
+	// FNV-1a
+	static uint64_t hashName(const char* name, size_t length)
+	{
+		uint64_t hash = 0xcbf29ce484222325ull;
+		for (size_t i = 0; i < length; ++i)
+		{
+			hash ^= (u8) name[i];
+			hash *= 0x100000001b3ull;
+		}
+		return hash;
+	}
+
+	// splitmix64 finalizer over the parent's key and the name
+	static uint64_t hashChild(uint64_t parentKey, uint64_t nameHash)
+	{
+		uint64_t x = parentKey * 0x9e3779b97f4a7c15ull ^ nameHash;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+		x ^= x >> 31;
+		return x ? x : 1;
+	}
+
+	static const uint64_t rootKey = 1;
+
+	void insert(uint64_t key, uint64_t inode)
+	{
+		for (uint64_t i = key & mask;; i = (i + 1) & mask)
+		{
+			uint64_t expected = 0;
+			if (slots[i].key.compare_exchange_strong(expected, key))
+			{
+				slots[i].inode = inode;
+				return;
+			}
+		}
+	}
+
+	// hash and insert every entry of dir, returning the subdirectories with their keys
+	void indexDirectory(uint64_t dir, uint64_t key, std::vector<std::pair<uint64_t, uint64_t>>& subdirs)
+	{
+		uint64_t first = fs.getArrayIndex(dir);
+		uint64_t count = fs.getNumEntries(dir);
+		for (uint64_t id = first; id < first + count; ++id)
+		{
+			const char* name = fs.getName(id);
+			uint64_t childKey = hashChild(key, hashName(name, strlen(name)));
+			insert(childKey, id);
+			parents[(size_t) id] = dir;
+			if (S_ISDIR(fs.getMode(id)))
+				subdirs.push_back(std::make_pair(id, childKey));
+		}
+	}
+
+	void indexSubtree(uint64_t dir, uint64_t key)
+	{
+		std::vector<std::pair<uint64_t, uint64_t>> pending(1, std::make_pair(dir, key));
+		while (!pending.empty())
+		{
+			auto next = pending.back();
+			pending.pop_back();
+			indexDirectory(next.first, next.second, pending);
+		}
+	}
+
+	// Breadth first from the root until there are enough directories to keep
+	// every thread busy, then each of those subtrees is indexed as one task.
+	void build(unsigned threads)
+	{
+		uint64_t files = fs.superblock.files;
+		uint64_t capacity = 16;
+		while (capacity < files * 2)
+			capacity <<= 1;
+		slots.reset(new slot[(size_t) capacity]());
+		mask = capacity - 1;
+		parents.assign((size_t) files, AXFS_NO_INODE);
+
+		std::vector<std::pair<uint64_t, uint64_t>> frontier(1, std::make_pair((uint64_t) 0, (uint64_t) rootKey));
+		threads = std::max(threads, 1u);
+		while (!frontier.empty() && frontier.size() < threads * 8)
+		{
+			std::vector<std::pair<uint64_t, uint64_t>> next;
+			for (auto& dir : frontier)
+				indexDirectory(dir.first, dir.second, next);
+			frontier.swap(next);
+		}
+
+		axfs_work_pool pool(threads);
+		for (auto& dir : frontier)
+			pool.push([this, dir] { indexSubtree(dir.first, dir.second); });
+		pool.run();
+	}
+
+	uint64_t memoryUsage() const
+	{
+		return (mask + 1) * sizeof(slot) + parents.size() * sizeof(uint64_t);
+	}
+
+	// Same answers as axfs::lookup.  Paths with ".." depend on which components
+	// exist, those are left to the directory search.
+	uint64_t find(const char* fullPath) const
+	{
+		std::vector<std::pair<const char*, size_t>> components;
+		uint64_t key = rootKey;
+		const char* path = fullPath;
+		while (*path)
+		{
+			const char* end = strchr(path, '/');
+			size_t length = end ? (size_t)(end - path) : strlen(path);
+			if (length == 2 && path[0] == '.' && path[1] == '.')
+				return fs.searchPath(fullPath);
+			if (length > 0 && !(length == 1 && path[0] == '.'))
+			{
+				components.push_back(std::make_pair(path, length));
+				key = hashChild(key, hashName(path, length));
+			}
+			path += length;
+			if (*path == '/')
+				++path;
+		}
+		if (components.empty())
+			return 0;
+
+		for (uint64_t i = key & mask; slots[i].key != 0; i = (i + 1) & mask)
+		{
+			if (slots[i].key == key && matches(slots[i].inode, components))
+				return slots[i].inode;
+		}
+		return AXFS_NO_INODE;
+	}
+
+	bool matches(uint64_t id, const std::vector<std::pair<const char*, size_t>>& components) const
+	{
+		for (size_t i = components.size(); i-- > 0;)
+		{
+			if (id == 0 || id == AXFS_NO_INODE)
+				return false;
+			if (axfs::compareName(fs.getName(id), components[i].first, components[i].second) != 0)
+				return false;
+			id = parents[(size_t) id];
+		}
+		return id == 0;
+	}
+};
+
+inline uint64_t axfs::lookup(const char* path) const
+{
+	return pathIndex ? pathIndex->find(path) : searchPath(path);
+}
+
+inline void axfs::indexPaths(unsigned threads)
+{
+	pathIndex.reset();
+	std::shared_ptr<axfs_path_index> index = std::make_shared<axfs_path_index>(*this);
+	index->build(threads);
+	pathIndex = index;
+	if (source.verbose)
+		printf("path index: %" PRIu64 " slots, %" PRIu64 " bytes\n", index->mask + 1, index->memoryUsage());
+}
+
+// what an AXFS_OK or AXFS_ERR_* result means, axfs_strerror of libaxfs.h
+static const char* axfs_error_text(int error)
+{
+	switch (error)
+	{
+	case AXFS_OK: return "success";
+	case AXFS_ERR_IO: return "image could not be opened or read";
+	case AXFS_ERR_FORMAT: return "not an AXFS image or inconsistent metadata";
+	case AXFS_ERR_UNSUPPORTED: return "compression not built in";
+	case AXFS_ERR_CORRUPT: return "compressed data is corrupt";
+	case AXFS_ERR_NOMEM: return "out of memory";
+	case AXFS_ERR_INVAL: return "invalid argument";
+	case AXFS_ERR_NOENT: return "no such file or directory";
+	case AXFS_ERR_NOTDIR: return "not a directory";
+	case AXFS_ERR_ISDIR: return "is a directory";
+	default: return "unknown error";
+	}
+}
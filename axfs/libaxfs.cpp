@@ -0,0 +1,167 @@
+// libaxfs.cpp : libaxfs.h, the reader behind a C interface.  Images are mapped
+// and verified at open, and nothing is printed.  The builder, extractor, FUSE
+// server and benchmarks of the command line tool are not part of the library.
+//
+// LICENSE: GPL v2.  This project is a derivative work of the linux kernel.
+
+#include "stdafx.h"
+#include "axfs_reader.h"
+
+struct axfs_image
+{
+	axfs fs;
+};
+
+template <typename Load>
+static int axfs_open_image(const axfs_open_options* options, axfs_image** image, Load load)
+{
+	if (!image)
+		return AXFS_ERR_INVAL;
+	*image = nullptr;
+	// flags and fields this version does not know about would be silently ignored
+	if (options && (options->flags & ~(uint32_t)(AXFS_OPEN_TRUSTED | AXFS_OPEN_PATH_INDEX)))
+		return AXFS_ERR_INVAL;
+	for (size_t i = 0; options && i < sizeof(options->reserved) / sizeof(options->reserved[0]); ++i)
+	{
+		if (options->reserved[i])
+			return AXFS_ERR_INVAL;
+	}
+	try
+	{
+		std::unique_ptr<axfs_image> opened(new axfs_image);
+		opened->fs.source.verbose = false;
+		if (options && options->codec && !(opened->fs.source.codec = axfs_find_codec(options->codec)))
+			return AXFS_ERR_UNSUPPORTED;
+		uint64_t cacheBytes = options && options->cache_bytes ? options->cache_bytes : AXFS_DEFAULT_CACHE_SIZE;
+		opened->fs.tableBytes = options ? options->table_bytes : 0;
+		int result = load(opened->fs, cacheBytes);
+		if (result == AXFS_OK && !(options && (options->flags & AXFS_OPEN_TRUSTED)))
+			result = opened->fs.verify();
+		if (result != AXFS_OK)
+			return result;
+		if (options && (options->flags & AXFS_OPEN_PATH_INDEX))
+			opened->fs.indexPaths(std::thread::hardware_concurrency());
+		*image = opened.release();
+		return AXFS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return AXFS_ERR_NOMEM;
+	}
+}
+
+extern "C" int axfs_open_path(const char* path, const axfs_open_options* options, axfs_image** image)
+{
+	if (!path)
+		return AXFS_ERR_INVAL;
+	return axfs_open_image(options, image, [path](axfs& fs, uint64_t cacheBytes) {
+		return fs.load(path, AXFS_LOAD_MMAP, cacheBytes);
+	});
+}
+
+extern "C" int axfs_open_fd(int fd, const axfs_open_options* options, axfs_image** image)
+{
+	return axfs_open_image(options, image, [fd](axfs& fs, uint64_t cacheBytes) {
+		return fs.image.openFd(fd) ? fs.loadMapped(cacheBytes) : AXFS_ERR_IO;
+	});
+}
+
+extern "C" int axfs_open_memory(const void* data, size_t size, const axfs_open_options* options, axfs_image** image)
+{
+	if (!data)
+		return AXFS_ERR_INVAL;
+	return axfs_open_image(options, image, [data, size](axfs& fs, uint64_t cacheBytes) {
+		fs.image.borrow(data, size);
+		return fs.loadMapped(cacheBytes);
+	});
+}
+
+extern "C" void axfs_close(axfs_image* image)
+{
+	delete image;
+}
+
+extern "C" int axfs_stat_inode(const axfs_image* image, uint64_t inode, axfs_stat* st)
+{
+	if (!image || !st || inode >= image->fs.superblock.files)
+		return AXFS_ERR_INVAL;
+	const axfs& fs = image->fs;
+	memset(st, 0, sizeof(*st));
+	st->inode = inode;
+	st->mode = fs.getMode(inode);
+	st->uid = fs.getUid(inode);
+	st->gid = fs.getGid(inode);
+	if (S_ISREG(st->mode) || S_ISDIR(st->mode) || S_ISLNK(st->mode))
+		st->size = fs.getFileSize(inode);
+	else
+		st->rdev = fs.getFileSize(inode) & 0xffff;	// device numbers are kept in the size
+	if (S_ISDIR(st->mode))
+		st->entries = fs.getNumEntries(inode);
+	else
+		st->entries = (st->size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	return AXFS_OK;
+}
+
+extern "C" int axfs_lookup_path(const axfs_image* image, const char* path, uint64_t* inode)
+{
+	if (!image || !path || !inode)
+		return AXFS_ERR_INVAL;
+	try
+	{
+		*inode = image->fs.lookup(path);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return AXFS_ERR_NOMEM;
+	}
+	return *inode == AXFS_NO_INODE ? AXFS_ERR_NOENT : AXFS_OK;
+}
+
+extern "C" int axfs_stat_path(const axfs_image* image, const char* path, axfs_stat* st)
+{
+	uint64_t inode;
+	int result = axfs_lookup_path(image, path, &inode);
+	return result == AXFS_OK ? axfs_stat_inode(image, inode, st) : result;
+}
+
+extern "C" int axfs_readdir(const axfs_image* image, uint64_t dir, uint64_t* cookie, axfs_dirent* entry)
+{
+	if (!image || !cookie || !entry || dir >= image->fs.superblock.files)
+		return AXFS_ERR_INVAL;
+	const axfs& fs = image->fs;
+	if (!S_ISDIR(fs.getMode(dir)))
+		return AXFS_ERR_NOTDIR;
+	if (*cookie >= fs.getNumEntries(dir))
+		return 0;
+	uint64_t id = fs.getArrayIndex(dir) + *cookie;
+	entry->inode = id;
+	entry->mode = fs.getMode(id);
+	entry->name = fs.getName(id);
+	++*cookie;
+	return 1;
+}
+
+extern "C" int64_t axfs_read(const axfs_image* image, uint64_t inode, void* buffer, uint64_t size, uint64_t offset)
+{
+	if (!image || (!buffer && size > 0) || inode >= image->fs.superblock.files || offset > INT64_MAX)
+		return AXFS_ERR_INVAL;
+	const axfs& fs = image->fs;
+	auto mode = fs.getMode(inode);
+	if (S_ISDIR(mode))
+		return AXFS_ERR_ISDIR;
+	if (!S_ISREG(mode) && !S_ISLNK(mode))
+		return AXFS_ERR_INVAL;
+	uint64_t fileSize = fs.getFileSize(inode);
+	if (offset >= fileSize)
+		return 0;
+	// the count has to fit the result
+	size = std::min(std::min(size, fileSize - offset), (uint64_t) INT64_MAX);
+	if (!fs.readFile(inode, buffer, offset, size))
+		return AXFS_ERR_CORRUPT;
+	return (int64_t) size;
+}
+
+extern "C" const char* axfs_strerror(int error)
+{
+	return axfs_error_text(error);
+}
@@ -0,0 +1,116 @@
+// libaxfs.h : the reader as a library, a C interface that stays stable across
+// changes to the reader's internals.
+//
+// LICENSE: GPL v2.  This project is a derivative work of the linux kernel.
+//
+//	axfs_image* image;
+//	if (axfs_open_path("rootfs.axfs", NULL, &image) == AXFS_OK)
+//	{
+//		struct axfs_stat st;
+//		if (axfs_stat_path(image, "etc/hostname", &st) == AXFS_OK)
+//			axfs_read(image, st.inode, buffer, st.size, 0);
+//		axfs_close(image);
+//	}
+//
+// Every function but axfs_close may be called from many threads at once on the
+// same image.  Inode 0 is the root directory.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef AXFS_API
+#if defined(_WIN32) && defined(AXFS_SHARED_LIBRARY)
+#define AXFS_API __declspec(dllexport)
+#elif defined(__GNUC__)
+#define AXFS_API __attribute__((visibility("default")))
+#else
+#define AXFS_API
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* results, negative for errors */
+#define AXFS_OK 0
+#define AXFS_ERR_IO -1	/* the image could not be opened or read */
+#define AXFS_ERR_FORMAT -2	/* not an AXFS image, or its metadata is inconsistent */
+#define AXFS_ERR_UNSUPPORTED -3	/* compressed with a codec that is not built in */
+#define AXFS_ERR_CORRUPT -4	/* compressed data failed to inflate */
+#define AXFS_ERR_NOMEM -5
+#define AXFS_ERR_INVAL -6	/* inode out of range or bad argument */
+#define AXFS_ERR_NOENT -7	/* no such path */
+#define AXFS_ERR_NOTDIR -8
+#define AXFS_ERR_ISDIR -9
+
+/* axfs_open_options::flags */
+#define AXFS_OPEN_TRUSTED 1	/* skip checking the metadata against the image at open */
+#define AXFS_OPEN_PATH_INDEX 2	/* hash every path at open, so path lookups take one probe */
+
+typedef struct axfs_image axfs_image;
+
+struct axfs_open_options
+{
+	uint32_t flags;
+	uint64_t cache_bytes;	/* bound on inflated cblocks kept in memory, 0 for the default;
+				   less than one cblock caches nothing */
+	const char* codec;	/* backend to inflate with, "zlib" for instance, NULL for the default */
+	uint64_t table_bytes;	/* memory for expanding the hottest lookup tables into native
+				   arrays at open, 0 keeps them as stored */
+	uint64_t reserved[3];	/* set to 0 */
+};
+
+struct axfs_stat
+{
+	uint64_t inode;
+	uint64_t mode;	/* st_mode bits */
+	uint64_t uid;
+	uint64_t gid;
+	uint64_t size;	/* 0 for devices */
+	uint64_t rdev;	/* major << 8 | minor for devices */
+	uint64_t entries;	/* directory entries, or pages of a file */
+	uint64_t reserved[4];
+};
+
+struct axfs_dirent
+{
+	uint64_t inode;
+	uint64_t mode;
+	const char* name;	/* valid until the image is closed */
+};
+
+/* Open an image by path or from a descriptor, both mapped into memory; the
+   descriptor may be closed afterwards.  options may be NULL; unknown flags or
+   reserved fields that are not 0 give AXFS_ERR_INVAL. */
+AXFS_API int axfs_open_path(const char* path, const struct axfs_open_options* options, axfs_image** image);
+AXFS_API int axfs_open_fd(int fd, const struct axfs_open_options* options, axfs_image** image);
+
+/* Use an image already in memory, which must outlive the axfs_image. */
+AXFS_API int axfs_open_memory(const void* data, size_t size, const struct axfs_open_options* options, axfs_image** image);
+
+AXFS_API void axfs_close(axfs_image* image);
+
+AXFS_API int axfs_stat_inode(const axfs_image* image, uint64_t inode, struct axfs_stat* st);
+
+/* Paths are relative to the root, a leading '/' is allowed; "." and ".." are
+   resolved and symbolic links are not followed. */
+AXFS_API int axfs_lookup_path(const axfs_image* image, const char* path, uint64_t* inode);
+AXFS_API int axfs_stat_path(const axfs_image* image, const char* path, struct axfs_stat* st);
+
+/* Entry number *cookie of directory dir, advancing *cookie.  Start with a cookie
+   of 0.  Returns 1 with an entry, 0 at the end or an error. */
+AXFS_API int axfs_readdir(const axfs_image* image, uint64_t dir, uint64_t* cookie, struct axfs_dirent* entry);
+
+/* Read up to size bytes of a file or symbolic link from offset, which like an
+   off_t is at most INT64_MAX.  Returns the bytes read, 0 at or past the end, or
+   an error. */
+AXFS_API int64_t axfs_read(const axfs_image* image, uint64_t inode, void* buffer, uint64_t size, uint64_t offset);
+
+AXFS_API const char* axfs_strerror(int error);
+
+#ifdef __cplusplus
+}
+#endif
@@ -8,9 +8,73 @@
 #include "targetver.h"
 
 #include <stdio.h>
-#include <tchar.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <algorithm>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <deque>
+#include <functional>
+#include <string>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <map>
+#include <set>
+#include <tuple>
+
+// optional inflate backends, see axfs_codecs
+#ifdef AXFS_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef AXFS_HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifdef AXFS_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef AXFS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef AXFS_HAVE_LZMA
+#include <lzma.h>
+#endif
+
+// optional FUSE server, see axfs_fuse
+#ifdef AXFS_HAVE_FUSE
+#define FUSE_USE_VERSION 31
+#include <fuse_lowlevel.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <tchar.h>
+#include <io.h>	// _get_osfhandle
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>	// major, minor and makedev
+#endif
+#endif
 // TODO: reference additional headers your program requires here
@@ -0,0 +1,198 @@
+/* capi.c : libaxfs.h against the tree an image was built from.  Opens the image
+   from memory and from a descriptor, walks it with axfs_readdir, compares every
+   entry's stat and contents, partly at an offset, with the tree and checks the
+   error codes.
+   usage: capi <tree> <image> */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libaxfs.h"
+
+static int failures;
+
+#define CHECK(condition, ...) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			printf("FAILED: " __VA_ARGS__); \
+			printf("\n"); \
+			++failures; \
+		} \
+	} while (0)
+
+static void* readAll(const char* path, size_t* size)
+{
+	FILE* f = fopen(path, "rb");
+	if (!f)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	*size = (size_t) ftell(f);
+	fseek(f, 0, SEEK_SET);
+	void* data = malloc(*size ? *size : 1);
+	if (data && fread(data, 1, *size, f) != *size)
+	{
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	return data;
+}
+
+/* the whole of a file or link, and a piece from an offset in the middle */
+static void compareContents(const axfs_image* image, const struct axfs_stat* st, const char* host, const char* path)
+{
+	size_t size = 0;
+	char* expected;
+	if (S_ISLNK(st->mode))
+	{
+		expected = malloc(st->size + 1);
+		size = (size_t) readlink(host, expected, st->size + 1);
+	}
+	else
+	{
+		expected = readAll(host, &size);
+	}
+	CHECK(expected && size == st->size, "%s: size %llu, tree has %llu", path, (unsigned long long) st->size, (unsigned long long) size);
+	if (!expected || size != st->size)
+	{
+		free(expected);
+		return;
+	}
+
+	char* actual = malloc(size + 1);
+	CHECK(axfs_read(image, st->inode, actual, size + 1, 0) == (int64_t) size && memcmp(actual, expected, size) == 0,
+		"%s: contents differ", path);
+	uint64_t offset = size / 3 + 1;
+	uint64_t count = size / 2;
+	if (offset < size)
+	{
+		CHECK(axfs_read(image, st->inode, actual, count, offset) == (int64_t) count && memcmp(actual, expected + offset, (size_t) count) == 0,
+			"%s: contents at %llu differ", path, (unsigned long long) offset);
+	}
+	CHECK(axfs_read(image, st->inode, actual, 1, size) == 0, "%s: read at the end", path);
+	free(actual);
+	free(expected);
+}
+
+/* every entry of dir, which is path in the image and host in the tree */
+static void compareDirectory(const axfs_image* image, uint64_t dir, const char* host, const char* path)
+{
+	uint64_t cookie = 0;
+	uint64_t entries = 0;
+	struct axfs_dirent entry;
+	while (axfs_readdir(image, dir, &cookie, &entry) == 1)
+	{
+		char hostPath[4096];
+		char imagePath[4096];
+		snprintf(hostPath, sizeof(hostPath), "%s/%s", host, entry.name);
+		snprintf(imagePath, sizeof(imagePath), "%s/%s", path, entry.name);
+		++entries;
+
+		struct stat expected;
+		struct axfs_stat st;
+		CHECK(lstat(hostPath, &expected) == 0, "%s: not in the tree", imagePath);
+		CHECK(axfs_stat_path(image, imagePath, &st) == AXFS_OK && st.inode == entry.inode && st.mode == entry.mode,
+			"%s: stat_path does not match readdir", imagePath);
+		CHECK(st.mode == expected.st_mode && st.uid == expected.st_uid && st.gid == expected.st_gid,
+			"%s: mode or owner differs", imagePath);
+
+		if (S_ISDIR(st.mode))
+		{
+			CHECK(axfs_read(image, st.inode, NULL, 0, 0) == AXFS_ERR_ISDIR, "%s: read of a directory", imagePath);
+			compareDirectory(image, st.inode, hostPath, imagePath);
+		}
+		else
+		{
+			uint64_t none = 0;
+			CHECK(axfs_readdir(image, st.inode, &none, &entry) == AXFS_ERR_NOTDIR, "%s: readdir of a file", imagePath);
+			compareContents(image, &st, hostPath, imagePath);
+		}
+	}
+
+	uint64_t expectedEntries = 0;
+	DIR* d = opendir(host);
+	struct dirent* e;
+	while (d && (e = readdir(d)))
+		expectedEntries += strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0;
+	if (d)
+		closedir(d);
+	CHECK(entries == expectedEntries, "%s: %llu entries, tree has %llu", path, (unsigned long long) entries, (unsigned long long) expectedEntries);
+}
+
+static void compareImage(const axfs_image* image, const char* tree)
+{
+	compareDirectory(image, 0, tree, "");
+
+	struct axfs_stat st;
+	uint64_t inode;
+	char byte;
+	CHECK(axfs_stat_path(image, "/no/such/file", &st) == AXFS_ERR_NOENT, "missing path");
+	CHECK(axfs_lookup_path(image, "dir/nothing", &inode) == AXFS_ERR_NOENT, "missing name");
+	CHECK(axfs_stat_path(image, "dir/../one", &st) == AXFS_OK && st.size == 1, "path through ..");
+	CHECK(axfs_read(image, st.inode, &byte, 1, (uint64_t) INT64_MAX + 1) == AXFS_ERR_INVAL, "offset past INT64_MAX");
+	CHECK(axfs_read(image, st.inode, NULL, 1, 0) == AXFS_ERR_INVAL, "read into NULL");
+	CHECK(axfs_stat_inode(image, (uint64_t) -1, &st) == AXFS_ERR_INVAL, "inode out of range");
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 3)
+	{
+		printf("usage: capi <tree> <image>\n");
+		return 2;
+	}
+	const char* tree = argv[1];
+	size_t size = 0;
+	void* data = readAll(argv[2], &size);
+	if (!data)
+	{
+		printf("%s: cannot read\n", argv[2]);
+		return 1;
+	}
+
+	axfs_image* image;
+	int result = axfs_open_memory(data, size, NULL, &image);
+	CHECK(result == AXFS_OK, "axfs_open_memory: %s", axfs_strerror(result));
+	if (result == AXFS_OK)
+	{
+		compareImage(image, tree);
+		axfs_close(image);
+	}
+
+	/* the descriptor is closed before the image is used */
+	struct axfs_open_options options;
+	memset(&options, 0, sizeof(options));
+	options.flags = AXFS_OPEN_PATH_INDEX;
+	int fd = open(argv[2], O_RDONLY);
+	result = axfs_open_fd(fd, &options, &image);
+	close(fd);
+	CHECK(result == AXFS_OK, "axfs_open_fd: %s", axfs_strerror(result));
+	if (result == AXFS_OK)
+	{
+		compareImage(image, tree);
+		axfs_close(image);
+	}
+
+	options.flags = 1u << 31;
+	CHECK(axfs_open_memory(data, size, &options, &image) == AXFS_ERR_INVAL, "unknown flag");
+	options.flags = 0;
+	options.reserved[0] = 1;
+	CHECK(axfs_open_memory(data, size, &options, &image) == AXFS_ERR_INVAL, "reserved field set");
+	CHECK(axfs_open_fd(-1, NULL, &image) == AXFS_ERR_IO, "bad descriptor");
+
+	/* the metadata points past a truncated image */
+	CHECK(axfs_open_memory(data, size / 2, NULL, &image) < 0, "image truncated to half");
+	CHECK(axfs_open_memory(data, size - 1, NULL, &image) < 0, "image missing its last byte");
+
+	free(data);
+	if (failures)
+		printf("%d checks failed\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# mkfs a tree, serve the image with axfs mount and read it back through the
+# kernel with ls, readlink and diff.  Skipped (77) without a usable /dev/fuse.
+# usage: mount.sh <axfs binary> <scratch directory>
+set -e
+axfs=$1
+work=$2
+if [ ! -c /dev/fuse ] || [ ! -r /dev/fuse ] || [ ! -w /dev/fuse ]; then
+	echo "no /dev/fuse"
+	exit 77
+fi
+. "$(dirname "$0")/tree.sh"
+
+"$axfs" mkfs "$tree" "$work/image" -t 3000 > "$work/mkfs.log"
+mnt=$work/mnt
+mkdir "$mnt"
+"$axfs" mount "$work/image" "$mnt" -f > "$work/mount.log" 2>&1 &
+server=$!
+
+unmount()
+{
+	fusermount3 -u "$mnt" 2> /dev/null || umount "$mnt" 2> /dev/null || true
+}
+trap unmount EXIT
+
+tries=0
+while [ ! -e "$mnt/one" ]; do
+	if ! kill -0 $server 2> /dev/null || [ $tries -ge 100 ]; then
+		echo "FAILED: not mounted"
+		cat "$work/mount.log"
+		exit 1
+	fi
+	sleep 0.1
+	tries=$((tries + 1))
+done
+
+ls -lR "$mnt" > "$work/ls.log"
+[ "$(readlink "$mnt/link")" = dir/text ]
+[ "$(cat "$mnt/dir/readonly")" = "read only" ]
+diff -r "$tree" "$mnt"
+if echo x > "$mnt/new" 2> /dev/null; then
+	echo "FAILED: the mount is writable"
+	exit 1
+fi
+
+unmount
+trap - EXIT
+wait $server
@@ -0,0 +1,38 @@
+#!/bin/sh
+# mkfs a tree, extract the image again and compare, for a set of mkfs options
+# usage: roundtrip.sh <axfs binary> <scratch directory>
+set -e
+axfs=$1
+work=$2
+. "$(dirname "$0")/tree.sh"
+
+printf 'dir/random,0,9\ndir/random,8192,3\npage,0,1\n' > "$work/profile"
+
+status=0
+run()
+{
+	name=$1
+	shift
+	if ! "$axfs" mkfs "$tree" "$work/$name.img" "$@" > "$work/$name.mkfs.log" ||
+		! "$axfs" extract "$work/$name.img" "$work/$name" > "$work/$name.extract.log" ||
+		! diff -r "$tree" "$work/$name"; then
+		echo "FAILED: mkfs $*"
+		status=1
+	fi
+}
+
+run default
+run metadata -m -p
+run tails -t 3000 -d 4
+run wide -d 8 -m
+run strict -P -D -b 4096
+run xip -x "$work/profile"
+run spill -M 1 -x "$work/profile" -t 3000
+# without dedupe spilling does not change the image at all
+run held -D -x "$work/profile" -t 3000
+run spilled -D -M 1 -x "$work/profile" -t 3000
+if ! cmp "$work/held.img" "$work/spilled.img"; then
+	echo "FAILED: -M changed the image"
+	status=1
+fi
+exit $status
@@ -0,0 +1,26 @@
+# sourced by the tests: makes $work/tree, files around a page in size and one
+# of several cblocks, duplicates, a read-only file and a symlink
+rm -rf "$work"
+mkdir -p "$work/tree/dir/sub" "$work/tree/empty"
+tree=$work/tree
+
+: > "$tree/zero"
+printf x > "$tree/one"
+head -c 4095 /dev/urandom > "$tree/page.minus"
+head -c 4096 /dev/urandom > "$tree/page"
+head -c 4097 /dev/urandom > "$tree/page.plus"
+head -c 300000 /dev/urandom > "$tree/dir/random"
+i=0
+while [ $i -lt 2000 ]; do
+	echo "line $i" >> "$tree/dir/text"
+	i=$((i + 1))
+done
+cp "$tree/dir/text" "$tree/dir/sub/same"
+i=0
+while [ $i -lt 50 ]; do
+	echo "small $i" > "$tree/dir/sub/f$i"
+	i=$((i + 1))
+done
+echo "read only" > "$tree/dir/readonly"
+chmod 444 "$tree/dir/readonly"
+ln -s dir/text "$tree/link"